@@ -0,0 +1,345 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+    #include <io.h>
+    #include <fcntl.h>
+#endif
+
+#include "storage.h"
+
+Clock g_clock;
+
+// Imports historical readings straight into data.db instead of replaying
+// them through UDP. Input is read in large chunks and parsed in place, rows
+// are gathered per hour, and every finished hour is written as a sealed block
+// together with its minute and hour rollups, the way the server's sealing
+// would have left it. Hours that already have a block are merged with it.
+// Rows of the current hour (or later) go into the log partitions through one
+// prepared insert, so the server seals them as usual. Each batch of a few
+// million rows is one transaction. Everything loaded goes to one sensor's
+// series (-sensor, 0 by default).
+class Loader {
+public:
+    static const size_t BATCH_ROWS = 1 << 22;
+
+    DB& db;
+    int sensor;
+    int64_t cutoff; // start of the current hour; earlier hours are sealed here
+    std::map<int64_t, std::vector<Sample>> pending; // by hour
+    std::vector<Sample>* last;
+    int64_t last_hour;
+    size_t pending_rows;
+    int64_t rows, sealed_hours, logged;
+
+    Loader(DB& d, int id) : db(d), sensor(id), last(nullptr), last_hour(INT64_MIN), pending_rows(0), rows(0), sealed_hours(0), logged(0) {
+        cutoff = g_clock.Now() / MS_PER_HOUR * MS_PER_HOUR;
+    }
+
+    bool Add(Sample s) {
+        int64_t hour = s.time / MS_PER_HOUR;
+        if (hour != last_hour) {
+            last = &pending[hour];
+            last_hour = hour;
+        }
+        s.sensor = sensor;
+        last->push_back(s);
+        return ++pending_rows < BATCH_ROWS || Flush();
+    }
+
+    bool Flush() {
+        if (pending.empty()) return true;
+        if (!db.Exec("BEGIN;")) return false;
+        bool ok = true;
+        int64_t sealed = 0;
+        for (std::map<int64_t, std::vector<Sample>>::iterator it = pending.begin(); ok && it != pending.end(); ++it) {
+            std::vector<Sample>& hour_rows = it->second;
+            ok = db.EnsurePartition(it->first * MS_PER_HOUR / MS_PER_DAY);
+            if (!ok) break;
+            if (it->first * MS_PER_HOUR >= cutoff) {
+                for (size_t i = 0; ok && i < hour_rows.size(); i++) ok = db.Append(hour_rows[i]);
+                logged += hour_rows.size();
+                continue;
+            }
+            std::stable_sort(hour_rows.begin(), hour_rows.end(),
+                             [](const Sample& a, const Sample& b) { return a.time < b.time; });
+            ok = db.SealHour(sensor, it->first, hour_rows);
+            sealed++;
+        }
+        if (ok && sealed > 0) ok = db.Exec("UPDATE meta SET value = value + 1 WHERE key = 'generation';");
+        if (!ok) {
+            std::cout << "Load Error: " << sqlite3_errmsg(db.db) << std::endl;
+            db.Exec("ROLLBACK;");
+            return false;
+        }
+        if (!db.Exec("COMMIT;")) return false;
+
+        rows += pending_rows;
+        sealed_hours += sealed;
+        std::cout << "Committed " << rows << " rows" << std::endl;
+        pending.clear();
+        pending_rows = 0;
+        last = nullptr;
+        last_hour = INT64_MIN;
+        return true;
+    }
+};
+
+static bool Digit(char c) { return c >= '0' && c <= '9'; }
+
+static bool ParseDigits(const char*& p, const char* end, int count, int& value) {
+    value = 0;
+    for (int i = 0; i < count; i++, p++) {
+        if (p >= end || !Digit(*p)) return false;
+        value = value * 10 + (*p - '0');
+    }
+    return true;
+}
+
+// Epoch seconds ("1700000000", "1700000000.25"), epoch milliseconds (an
+// integer of 12 or more digits) or UTC "YYYY-MM-DD HH:MM:SS[.fff][Z]" with a
+// space or 'T' in the middle.
+static bool ParseTime(const char*& p, const char* end, int64_t& ms) {
+    if (end - p >= 5 && p[4] == '-') {
+        int y, mo, d, h, mi, s;
+        if (!ParseDigits(p, end, 4, y) || *p++ != '-' || !ParseDigits(p, end, 2, mo) || p >= end || *p++ != '-' ||
+            !ParseDigits(p, end, 2, d) || p >= end || (*p != ' ' && *p != 'T')) return false;
+        p++;
+        if (!ParseDigits(p, end, 2, h) || p >= end || *p++ != ':' || !ParseDigits(p, end, 2, mi) ||
+            p >= end || *p++ != ':' || !ParseDigits(p, end, 2, s)) return false;
+        if (mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || s > 60) return false;
+        ms = DayFromDate(y, mo, d) * MS_PER_DAY + ((h * 60 + mi) * 60 + s) * 1000;
+        if (p < end && *p == '.') {
+            int64_t scale = 100;
+            for (p++; p < end && Digit(*p); p++, scale /= 10) ms += (*p - '0') * scale;
+        }
+        if (p < end && *p == 'Z') p++;
+        return true;
+    }
+
+    const char* start = p;
+    int64_t whole = 0;
+    int digits = 0;
+    for (; p < end && Digit(*p); p++, digits++) whole = whole * 10 + (*p - '0');
+    if (digits == 0 || digits > 15) return false;
+    if (p < end && *p == '.') {
+        ms = whole * 1000;
+        int64_t scale = 100;
+        for (p++; p < end && Digit(*p); p++, scale /= 10) ms += (*p - '0') * scale;
+        return true;
+    }
+    ms = (p - start >= 12) ? whole : whole * 1000;
+    return true;
+}
+
+// Degrees to hundredths without going through a double; anything unusual
+// (exponents, inf) falls back to strtod.
+static bool ParseValue(const char*& p, const char* end, int64_t& value) {
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    int64_t whole = 0;
+    int digits = 0;
+    for (; p < end && Digit(*p) && digits < 15; p++, digits++) whole = whole * 10 + (*p - '0');
+    int64_t frac = 0;
+    int frac_digits = 0;
+    bool round_up = false;
+    if (p < end && *p == '.') {
+        for (p++; p < end && Digit(*p); p++, frac_digits++) {
+            if (frac_digits < 2) frac = frac * 10 + (*p - '0');
+            else if (frac_digits == 2) round_up = (*p >= '5');
+        }
+    }
+    if (digits + frac_digits > 0 && (p >= end || (*p != 'e' && *p != 'E' && !Digit(*p)))) {
+        if (frac_digits == 1) frac *= 10;
+        value = whole * 100 + frac + (round_up ? 1 : 0);
+        if (negative) value = -value;
+        return true;
+    }
+
+    char buf[64];
+    size_t n = std::min<size_t>(end - start, sizeof(buf) - 1);
+    memcpy(buf, start, n);
+    buf[n] = 0;
+    char* stop;
+    double temp = strtod(buf, &stop);
+    if (stop == buf || !std::isfinite(temp) || fabs(temp) > 1e12) return false;
+    p = start + (stop - buf);
+    value = ToFixed(temp);
+    return true;
+}
+
+static void SkipBlanks(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+}
+
+// "time,temp" with ',', ';' or blanks between the fields; further columns
+// are ignored.
+static bool ParseLine(const char* p, const char* end, Sample& s) {
+    SkipBlanks(p, end);
+    if (!ParseTime(p, end, s.time) || s.time < 0) return false;
+    const char* field_end = p;
+    SkipBlanks(p, end);
+    if (p < end && (*p == ',' || *p == ';')) p++;
+    else if (p == field_end) return false;
+    SkipBlanks(p, end);
+    if (!ParseValue(p, end, s.value)) return false;
+    SkipBlanks(p, end);
+    return p == end || *p == ',' || *p == ';';
+}
+
+class Reader {
+public:
+    static const size_t CHUNK = 1 << 20;
+
+    FILE* in;
+    Loader& loader;
+    int64_t bad;
+    int64_t line;
+
+    Reader(FILE* f, Loader& l) : in(f), loader(l), bad(0), line(0) {}
+
+    void Bad(const char* p, const char* end) {
+        if (++bad <= 5) std::cout << "Skipping line " << line << ": " << std::string(p, std::min<size_t>(end - p, 80)) << std::endl;
+    }
+
+    bool Line(const char* p, const char* end) {
+        line++;
+        if (end > p && end[-1] == '\r') end--;
+        Sample s = {0, 0, 0, 0};
+        if (ParseLine(p, end, s)) return loader.Add(s);
+        const char* q = p;
+        SkipBlanks(q, end);
+        if (q == end) return true;
+        if (line > 1 || Digit(*q)) Bad(p, end); // a leading text line is the header
+        return true;
+    }
+
+    bool Csv() {
+        std::vector<char> buf(CHUNK);
+        size_t have = 0;
+        bool skipping = false; // inside a line longer than the buffer
+        while (true) {
+            size_t n = fread(&buf[have], 1, buf.size() - have, in);
+            have += n;
+            const char* p = &buf[0];
+            const char* end = p + have;
+            while (true) {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                if (!nl) break;
+                if (skipping) skipping = false;
+                else if (!Line(p, nl)) return false;
+                p = nl + 1;
+            }
+            have = end - p;
+            if (n == 0) {
+                if (have > 0 && !skipping && !Line(p, end)) return false;
+                return !ferror(in);
+            }
+            if (have == buf.size()) {
+                if (!skipping) {
+                    line++;
+                    Bad(p, end);
+                }
+                skipping = true;
+                have = 0;
+            } else {
+                memmove(&buf[0], p, have);
+            }
+        }
+    }
+
+    // Packed 16-byte records: int64 epoch milliseconds and a double in degrees,
+    // both in the machine's (little-endian) byte order.
+    bool Binary() {
+        std::vector<char> buf(CHUNK);
+        size_t have = 0;
+        while (true) {
+            size_t n = fread(&buf[have], 1, buf.size() - have, in);
+            have += n;
+            size_t used = 0;
+            for (; used + 16 <= have; used += 16) {
+                int64_t time;
+                double temp;
+                memcpy(&time, &buf[used], 8);
+                memcpy(&temp, &buf[used + 8], 8);
+                line++;
+                Sample s = { time, ToFixed(temp), 0, 0 };
+                if (time < 0 || !std::isfinite(temp) || fabs(temp) > 1e12) {
+                    if (++bad <= 5) std::cout << "Skipping record " << line << std::endl;
+                } else if (!loader.Add(s)) {
+                    return false;
+                }
+            }
+            have -= used;
+            memmove(&buf[0], &buf[used], have);
+            if (n == 0) {
+                if (have > 0) std::cout << "Ignoring " << have << " trailing bytes" << std::endl;
+                return !ferror(in);
+            }
+        }
+    }
+};
+
+int main(int argc, char* argv[]) {
+    bool binary = false;
+    int sensor = 0;
+    int arg = 1;
+    while (arg < argc) {
+        if (strcmp(argv[arg], "-binary") == 0) binary = true;
+        else if (strcmp(argv[arg], "-sensor") == 0 && arg + 1 < argc) sensor = std::max(0, atoi(argv[++arg]));
+        else break;
+        arg++;
+    }
+    if (arg >= argc) {
+        std::cout << "Usage: bulkload [-binary] [-sensor ID] <FILE|-> [DB_FILE]" << std::endl;
+        std::cout << "  CSV lines of time,temp; time as epoch seconds, epoch ms or UTC YYYY-MM-DD HH:MM:SS" << std::endl;
+        std::cout << "  -binary: 16-byte records of int64 epoch ms and double degrees" << std::endl;
+        std::cout << "  -sensor: store the readings as that sensor's (default 0)" << std::endl;
+        std::cout << "  DB_FILE defaults to data.db; stop the server while loading" << std::endl;
+        return 1;
+    }
+    const char* input = argv[arg];
+    const char* path = arg + 1 < argc ? argv[arg + 1] : "data.db";
+
+    FILE* in = stdin;
+    if (strcmp(input, "-") != 0) in = fopen(input, "rb");
+#ifdef _WIN32
+    else _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    if (!in) {
+        std::cout << "Can't open " << input << std::endl;
+        return 1;
+    }
+
+    g_clock.Tick();
+    DB db;
+    db.verbose = false;
+    if (!db.Open(path)) return 1;
+    db.Exec("PRAGMA cache_size = -65536;");
+
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    Loader loader(db, sensor);
+    Reader reader(in, loader);
+    bool ok = (binary ? reader.Binary() : reader.Csv()) && loader.Flush();
+    if (in != stdin) fclose(in);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Loaded " << loader.rows << " rows in " << seconds << " s ("
+              << (int64_t)(loader.rows / std::max(seconds, 1e-3)) << " rows/s): "
+              << loader.sealed_hours << " hour blocks written, " << loader.logged << " rows left in the log, "
+              << reader.bad << " bad lines" << std::endl;
+    if (!ok) {
+        std::cout << "Load stopped early; rows from the failed batch were not saved" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+// Binary framing of serial readings, shared by simulator.c and udp_sender.c
+// as the alternative to newline-terminated text:
+//   0  sync      FRAME_SYNC
+//   1  length    payload bytes, 1 to FRAME_MAX_PAYLOAD
+//   2  payload   a reading, little-endian: IEEE float (4 bytes), or u16
+//                channel and float (6 bytes) when several sensors share
+//                the link
+//   2+length     CRC16-CCITT (poly 0x1021, init 0xFFFF) of length and
+//                payload, little-endian
+// A receiver that sees a bad length or CRC drops only the sync byte and
+// looks for the next one, so it falls back into step within a frame or two
+// of line noise, and a corrupted reading is never taken for a good one.
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_SYNC 0xAA
+#define FRAME_MAX_PAYLOAD 32
+#define FRAME_OVERHEAD 4
+#define FRAME_MAX (FRAME_MAX_PAYLOAD + FRAME_OVERHEAD)
+
+static inline uint16_t frame_crc_add(uint16_t crc, uint8_t byte) {
+    crc ^= (uint16_t)byte << 8;
+    for (int i = 0; i < 8; i++) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    return crc;
+}
+
+static inline uint16_t frame_crc(const unsigned char* p, int len) {
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < len; i++) crc = frame_crc_add(crc, p[i]);
+    return crc;
+}
+
+// Writes the frame of a reading into `out` (FRAME_MAX bytes); returns its
+// size. `channel` is -1 on a link with a single sensor.
+static inline int frame_encode(unsigned char* out, int channel, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int len = 0;
+    out[0] = FRAME_SYNC;
+    if (channel >= 0) {
+        out[2] = (unsigned char)channel;
+        out[3] = (unsigned char)(channel >> 8);
+        len = 2;
+    }
+    for (int i = 0; i < 4; i++) out[2 + len + i] = (unsigned char)(bits >> (8 * i));
+    len += 4;
+    out[1] = (unsigned char)len;
+    uint16_t crc = frame_crc(out + 1, len + 1);
+    out[2 + len] = (unsigned char)crc;
+    out[3 + len] = (unsigned char)(crc >> 8);
+    return len + FRAME_OVERHEAD;
+}
+
+// The reading in a frame's payload, with `channel` -1 when it has none; 0
+// when the payload isn't a reading.
+static inline int frame_decode(const unsigned char* payload, int len, int* channel, float* value) {
+    if (len != 4 && len != 6) return 0;
+    *channel = len == 6 ? (payload[0] | payload[1] << 8) : -1;
+    const unsigned char* p = payload + len - 4;
+    uint32_t bits = 0;
+    for (int i = 3; i >= 0; i--) bits = (bits << 8) | p[i];
+    memcpy(value, &bits, sizeof(bits));
+    return 1;
+}
+
+#endif
@@ -0,0 +1,465 @@
+/* End-to-end benchmark: runs simulator -> sender -> server on one Linux box,
+   with pseudo-terminals standing in for the serial cables, and reports
+   throughput, loss and latency.
+
+   Each serial link gets two pty pairs: one per sensor, or a single framed
+   one all sensors share with -mux. The simulator writes to the slave of the
+   first; the harness relays its master to the master of the second, whose
+   slave the sender reads. Every reading is timestamped as the harness hands
+   it to the sender's pty, and again when the server logs the commit that
+   stored it ("Saved ..."). Readings are matched in order, which holds on
+   loopback as long as the report shows no loss. The server's own breakdown
+   of that time by stage follows; only numbered readings (-seq, -reliable)
+   carry the time they came in to the sender, so text runs show the server
+   side alone. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "frame.h"
+
+#define MAX_LINKS 64
+#define MAX_SENSORS 10000
+
+typedef struct {
+    int sim_master;     /* the simulator writes into this pair */
+    int sim_slave;      /* held open so the master never sees a hangup */
+    int snd_master;     /* and the sender reads from this one */
+    int snd_slave;
+    char sim_name[64];
+    char snd_name[64];
+    int frame_left;     /* framed: bytes left of the current frame, -1 looking for sync */
+    unsigned long written;
+} Link;
+
+/* Times (ns) readings were written to the sender, oldest first. */
+typedef struct {
+    long long* at;
+    size_t count, capacity;
+} Times;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void times_push(Times* t, long long ns) {
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity * 2 : 65536;
+        t->at = (long long*)realloc(t->at, t->capacity * sizeof(long long));
+        if (!t->at) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    t->at[t->count++] = ns;
+}
+
+/* Opens a raw pty pair; the slave is opened too, so reads on the master wait
+   for data instead of failing while nobody else has the slave open. */
+int open_pty(int* master, int* slave, char* name, size_t size) {
+    *master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (*master < 0 || grantpt(*master) != 0 || unlockpt(*master) != 0) return 0;
+    if (ptsname_r(*master, name, size) != 0) return 0;
+    *slave = open(name, O_RDWR | O_NOCTTY);
+    if (*slave < 0) return 0;
+    struct termios cfg;
+    tcgetattr(*master, &cfg);
+    cfmakeraw(&cfg);
+    tcsetattr(*master, TCSANOW, &cfg);
+    return 1;
+}
+
+/* Starts `argv` with stdout going to `out_fd` (or /dev/null when -1), in
+   directory `dir` when not NULL. */
+pid_t spawn(char* const argv[], int out_fd, const char* dir) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    if (dir && chdir(dir) != 0) _exit(127);
+    if (out_fd < 0) out_fd = open("/dev/null", O_WRONLY);
+    dup2(out_fd, 1);
+    dup2(out_fd, 2);
+    execv(argv[0], argv);
+    fprintf(stderr, "Can't run %s\n", argv[0]);
+    _exit(127);
+}
+
+/* Counts the readings that end in `data`, a chunk of what a simulator wrote. */
+int count_readings(Link* s, const char* data, int len, int framed) {
+    int n = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)data[i];
+        if (!framed) {
+            if (c == '\n') n++;
+        } else if (s->frame_left == -2) {
+            s->frame_left = c + 2; /* payload and CRC */
+        } else if (s->frame_left < 0) {
+            if (c == FRAME_SYNC) s->frame_left = -2; /* the length comes next */
+        } else if (--s->frame_left == 0) {
+            s->frame_left = -1;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Stored readings in a line of server output, 0 for other lines. */
+int stored_in(const char* line) {
+    int n;
+    if (strncmp(line, "Saved: ", 7) == 0) return 1;
+    if (sscanf(line, "Saved %d readings", &n) == 1) return n;
+    return 0;
+}
+
+int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile_ms(const long long* sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p / 100 * (n - 1) + 0.5);
+    return sorted[i] / 1e6;
+}
+
+/* The body of http://127.0.0.1:port/path into `out`; 0 on failure. */
+int http_get(int port, const char* path, char* out, size_t size) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return 0;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char request[256];
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: harness\r\nConnection: close\r\n\r\n", path);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || write(sock, request, strlen(request)) < 0) {
+        close(sock);
+        return 0;
+    }
+    size_t len = 0;
+    int got;
+    while (len < size - 1 && (got = read(sock, out + len, size - 1 - len)) > 0) len += got;
+    close(sock);
+    out[len] = '\0';
+    char* body = strstr(out, "\r\n\r\n");
+    if (!body) return 0;
+    memmove(out, body + 4, strlen(body + 4) + 1);
+    return 1;
+}
+
+/* The server's latency by stage (see Latency in server.cpp), from its
+   stats; `stats` is empty when it couldn't be asked. */
+void print_stages(const char* stats) {
+    const char* stages[] = { "sender", "network", "queue", "commit", "publish", "total" };
+    const char* latency = strstr(stats, "\"latency_ms\":");
+    if (!latency) {
+        printf("  (no stage latencies from the server)\n");
+        return;
+    }
+    printf("  server stages (ms)   count      mean      p50      p90      p99    p99.9      max\n");
+    for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "\"%s\":{", stages[i]);
+        const char* at = strstr(latency, key);
+        unsigned long long count;
+        double mean, p50, p90, p99, p999, max;
+        if (!at || sscanf(at + strlen(key), "\"count\":%llu,\"mean\":%lf,\"p50\":%lf,\"p90\":%lf,\"p99\":%lf,"
+                                             "\"p999\":%lf,\"max\":%lf", &count, &mean, &p50, &p90, &p99, &p999, &max) != 7)
+            continue;
+        if (count == 0) printf("    %-9s %12s\n", stages[i], "-");
+        else printf("    %-9s %12llu %9.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n", stages[i], count, mean, p50, p90, p99, p999, max);
+    }
+}
+
+void remove_dir(const char* dir) {
+    const char* files[] = { "data.db", "data.db-wal", "data.db-shm", "data.db.snap", "spool.bin", "sender.log" };
+    char path[512];
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+int main(int argc, char* argv[]) {
+    int sensors = 1, rate = 100, seconds = 10, framed = 0, baud = 115200, batch = -1;
+    int seq = 0, reliable = 0, keep = 0, mux = 0;
+    unsigned long seed = 1;
+    int udp_port = 20000 + (getpid() % 10000) * 2;
+    const char* bin = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-sensors") == 0 && i + 1 < argc) sensors = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc) rate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-seconds") == 0 && i + 1 < argc) seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-baud") == 0 && i + 1 < argc) baud = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-framed") == 0) framed = 1;
+        else if (strcmp(argv[i], "-mux") == 0) mux = framed = 1;
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc) batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-seq") == 0) seq = 1;
+        else if (strcmp(argv[i], "-reliable") == 0) reliable = 1;
+        else if (strcmp(argv[i], "-udp") == 0 && i + 1 < argc) udp_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-bin") == 0 && i + 1 < argc) bin = argv[++i];
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-keep") == 0) keep = 1;
+        else {
+            printf("Usage: harness [-sensors N] [-rate HZ] [-seconds S] [-baud RATE] [-framed | -mux] [-batch MS]\n"
+                   "               [-seq | -reliable] [-seed N] [-udp PORT] [-bin DIR] [-keep]\n");
+            printf("  -sensors N: sensors the simulator emulates, each on its own pty (default 1, at most %d)\n",
+                   MAX_LINKS);
+            printf("  -mux: all sensors share one framed pty instead (at most %d)\n", MAX_SENSORS);
+            printf("  -rate HZ: readings per second per sensor (default 100)\n");
+            printf("  -seconds S: how long the simulator runs (default 10)\n");
+            printf("  -baud, -framed: serial settings for simulator and sender (default 115200, text)\n");
+            printf("  -batch MS, -seq, -reliable: passed on to the sender\n");
+            printf("  -seed N: simulator seed, so runs repeat exactly (default 1)\n");
+            printf("  -udp PORT: server UDP port, HTTP is the next one (default from the process id)\n");
+            printf("  -bin DIR: where simulator, sender and server are (default: next to harness)\n");
+            printf("  -keep: leave the server's database and the sender's log behind\n");
+            return 1;
+        }
+    }
+    if (sensors < 1 || sensors > (mux ? MAX_SENSORS : MAX_LINKS) || rate < 1 || seconds < 1) {
+        printf("Bad -sensors, -rate or -seconds\n");
+        return 1;
+    }
+    int links = mux ? 1 : sensors;
+
+    char dir_bin[512];
+    if (!bin) {
+        snprintf(dir_bin, sizeof(dir_bin), "%s", argv[0]);
+        char* slash = strrchr(dir_bin, '/');
+        if (slash) *slash = '\0';
+        else snprintf(dir_bin, sizeof(dir_bin), ".");
+        bin = dir_bin;
+    }
+    char simulator[1100], sender[1100], server[1100];
+    snprintf(simulator, sizeof(simulator), "%s/simulator", bin);
+    snprintf(sender, sizeof(sender), "%s/sender", bin);
+    snprintf(server, sizeof(server), "%s/server", bin);
+    if (access(simulator, X_OK) != 0 || access(sender, X_OK) != 0 || access(server, X_OK) != 0) {
+        printf("Need simulator, sender and server in %s (see -bin)\n", bin);
+        return 1;
+    }
+    /* The children run in the work directory. */
+    char cwd[512];
+    if (bin[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+        snprintf(simulator, sizeof(simulator), "%s/%s/simulator", cwd, bin);
+        snprintf(sender, sizeof(sender), "%s/%s/sender", cwd, bin);
+        snprintf(server, sizeof(server), "%s/%s/server", cwd, bin);
+    }
+
+    char dir[] = "/tmp/harness.XXXXXX";
+    if (!mkdtemp(dir)) {
+        printf("Can't create a work directory\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    static Link s[MAX_LINKS];
+    for (int i = 0; i < links; i++) {
+        if (!open_pty(&s[i].sim_master, &s[i].sim_slave, s[i].sim_name, sizeof(s[i].sim_name)) ||
+            !open_pty(&s[i].snd_master, &s[i].snd_slave, s[i].snd_name, sizeof(s[i].snd_name))) {
+            printf("Can't create pseudo-terminals: %s\n", strerror(errno));
+            return 1;
+        }
+        s[i].frame_left = -1;
+    }
+
+    /* Server first, and wait until it listens. */
+    char udp[16], http[16];
+    snprintf(udp, sizeof(udp), "%d", udp_port);
+    snprintf(http, sizeof(http), "%d", udp_port + 1);
+    int out[2];
+    if (pipe(out) != 0) return 1;
+    char* server_argv[] = { server, udp, http, NULL };
+    pid_t server_pid = spawn(server_argv, out[1], dir);
+    close(out[1]);
+    FILE* server_out = fdopen(out[0], "r");
+    char line[512];
+    int running = 0;
+    while (!running && fgets(line, sizeof(line), server_out)) running = strncmp(line, "Server running!", 15) == 0;
+    if (!running) {
+        printf("Server didn't start (ports %s/%s busy?)\n", udp, http);
+        kill(server_pid, SIGTERM);
+        remove_dir(dir);
+        return 1;
+    }
+    int server_fd = out[0];
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    /* Shared links tag readings by channel, so the port needs no id. */
+    char devices[MAX_LINKS * 72] = "";
+    char sim_ports[MAX_LINKS * 72] = "";
+    for (int i = 0; i < links; i++) {
+        size_t used = strlen(devices);
+        if (mux) snprintf(devices, sizeof(devices), "%s", s[i].snd_name);
+        else snprintf(devices + used, sizeof(devices) - used, "%s%s=%d", i ? "," : "", s[i].snd_name, i + 1);
+        used = strlen(sim_ports);
+        snprintf(sim_ports + used, sizeof(sim_ports) - used, "%s%s", i ? "," : "", s[i].sim_name);
+    }
+    char baud_arg[16], batch_arg[16], rate_arg[16], sensors_arg[16], seed_arg[24];
+    snprintf(baud_arg, sizeof(baud_arg), "%d", baud);
+    snprintf(batch_arg, sizeof(batch_arg), "%d", batch);
+    snprintf(rate_arg, sizeof(rate_arg), "%d", rate);
+    snprintf(sensors_arg, sizeof(sensors_arg), "%d", sensors);
+    snprintf(seed_arg, sizeof(seed_arg), "%lu", seed);
+    char* sender_argv[16];
+    int n = 0;
+    sender_argv[n++] = sender;
+    sender_argv[n++] = devices;
+    sender_argv[n++] = (char*)"127.0.0.1";
+    sender_argv[n++] = udp;
+    sender_argv[n++] = (char*)"-baud";
+    sender_argv[n++] = baud_arg;
+    if (framed) sender_argv[n++] = (char*)"-framed";
+    if (batch >= 0) {
+        sender_argv[n++] = (char*)"-batch";
+        sender_argv[n++] = batch_arg;
+    }
+    if (seq) sender_argv[n++] = (char*)"-seq";
+    if (reliable) {
+        sender_argv[n++] = (char*)"-reliable";
+        sender_argv[n++] = (char*)"spool.bin";
+    }
+    sender_argv[n] = NULL;
+    char log_path[512];
+    snprintf(log_path, sizeof(log_path), "%s/sender.log", dir);
+    int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pid_t sender_pid = spawn(sender_argv, log_fd, dir);
+    close(log_fd);
+    usleep(200 * 1000); /* let it open the ports */
+
+    char batching[32] = "no batching";
+    if (batch >= 0) snprintf(batching, sizeof(batching), "batch %d ms", batch);
+    printf("Running %d sensor(s) at %d Hz for %d s: %s, %d baud, %s%s\n", sensors, rate, seconds,
+           mux ? "framed, one shared link" : framed ? "framed" : "text", baud, batching,
+           reliable ? ", reliable" : seq ? ", numbered" : "");
+    char* sim_argv[] = { simulator, sim_ports, (char*)"-sensors", sensors_arg, (char*)"-rate", rate_arg,
+                         (char*)"-seed", seed_arg, (char*)"-baud", baud_arg, framed ? (char*)"-framed" : NULL, NULL };
+    pid_t simulator_pid = spawn(sim_argv, -1, dir);
+
+    Times written = {0};
+    size_t stored = 0, extra = 0;
+    long long* latency = NULL;
+    size_t latencies = 0;
+    long long started = now_ns(), stop = started + (long long)seconds * 1000000000, last_store = started;
+    long long quiet = 0; /* when the drain gave up */
+    struct pollfd fds[MAX_LINKS + 1];
+    char buf[65536];
+    char pending[1024];
+    size_t pending_len = 0;
+    int simulating = 1;
+    while (1) {
+        long long now = now_ns();
+        if (simulating && now >= stop) {
+            kill(simulator_pid, SIGTERM);
+            simulating = 0;
+        }
+        /* After the simulator stops, wait for the last readings to be stored,
+           or for two seconds without progress. */
+        if (!simulating && (stored >= written.count || now - last_store > 2000000000LL)) {
+            quiet = now;
+            break;
+        }
+
+        for (int i = 0; i < links; i++) {
+            fds[i].fd = s[i].sim_master;
+            fds[i].events = POLLIN;
+        }
+        fds[links].fd = server_fd;
+        fds[links].events = POLLIN;
+        if (poll(fds, links + 1, 100) < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < links; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            int got = read(s[i].sim_master, buf, sizeof(buf));
+            if (got <= 0) continue;
+            for (int done = 0; done < got;) {
+                int w = write(s[i].snd_master, buf + done, got - done);
+                if (w < 0 && errno != EINTR) break;
+                if (w > 0) done += w;
+            }
+            int readings = count_readings(&s[i], buf, got, framed);
+            long long at = now_ns();
+            for (int k = 0; k < readings; k++) times_push(&written, at);
+            s[i].written += readings;
+        }
+
+        if (fds[links].revents & (POLLIN | POLLHUP)) {
+            int got;
+            while ((got = read(server_fd, pending + pending_len, sizeof(pending) - 1 - pending_len)) > 0) {
+                long long at = now_ns();
+                pending_len += got;
+                pending[pending_len] = '\0';
+                char* start = pending;
+                char* end;
+                while ((end = strchr(start, '\n'))) {
+                    *end = '\0';
+                    int k = stored_in(start);
+                    for (int j = 0; j < k; j++) {
+                        if (stored >= written.count) {
+                            extra++;
+                            continue;
+                        }
+                        if (latencies % 65536 == 0) {
+                            latency = (long long*)realloc(latency, (latencies + 65536) * sizeof(long long));
+                        }
+                        latency[latencies++] = at - written.at[stored++];
+                    }
+                    if (k > 0) last_store = at;
+                    start = end + 1;
+                }
+                pending_len -= start - pending;
+                memmove(pending, start, pending_len);
+                if (pending_len == sizeof(pending) - 1) pending_len = 0; /* an overlong line */
+            }
+            if (got == 0) {
+                printf("Server exited\n");
+                break;
+            }
+        }
+    }
+
+    kill(sender_pid, SIGTERM);
+    static char stats[1 << 20];
+    if (!http_get(udp_port + 1, "/api/stats", stats, sizeof(stats))) stats[0] = '\0';
+    kill(server_pid, SIGTERM);
+    waitpid(simulator_pid, NULL, 0);
+    waitpid(sender_pid, NULL, 0);
+    waitpid(server_pid, NULL, 0);
+
+    double run = (stop - started) / 1e9;
+    double span = (last_store - started) / 1e9;
+    size_t lost = written.count > stored ? written.count - stored : 0;
+    printf("  written  %10zu readings  %10.1f/s\n", written.count, written.count / run);
+    printf("  stored   %10zu readings  %10.1f/s\n", stored, span > 0 ? stored / span : 0.0);
+    printf("  lost     %10zu readings  %10.2f%%\n", lost, written.count ? 100.0 * lost / written.count : 0.0);
+    if (extra) printf("  extra    %10zu readings stored more than once\n", extra);
+    qsort(latency, latencies, sizeof(long long), compare_ll);
+    printf("  latency  p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f ms\n", percentile_ms(latency, latencies, 50),
+           percentile_ms(latency, latencies, 90), percentile_ms(latency, latencies, 99),
+           percentile_ms(latency, latencies, 99.9), latencies ? latency[latencies - 1] / 1e6 : 0.0);
+    print_stages(stats);
+    if (quiet && stored < written.count) printf("  (gave up waiting for the rest after 2 s without progress)\n");
+
+    if (keep) printf("Database and sender log kept in %s\n", dir);
+    else remove_dir(dir);
+    free(latency);
+    free(written.at);
+    return lost > 0;
+}
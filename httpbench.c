@@ -0,0 +1,329 @@
+/* HTTP benchmark: many clients at once against the dashboard and the API,
+   optionally while loadgen keeps the UDP port busy, reporting requests per
+   second and latency per path.
+
+   Each connection is a thread that sends its next request as soon as the
+   last one is answered, walking the list of paths in turn. Fresh mode opens
+   a connection per request, so latency includes the connect; -keepalive
+   asks to keep it and reuses it until the server closes it, retrying a
+   request that finds it closed on a new one. The report says how many
+   requests actually went over a reused connection. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MAX_CONNECTIONS 1024
+#define MAX_PATHS 16
+#define HEAD_MAX 16384
+
+typedef struct {
+    /* settings, the same for every connection */
+    struct sockaddr_in to;
+    int index, keepalive, paths;
+    char** path;
+    long long stop;     /* ns */
+    /* results */
+    long long* latency; /* us, by request */
+    unsigned char* which; /* path of each request */
+    size_t count, capacity;
+    unsigned long long errors[MAX_PATHS];
+    unsigned long long reused;
+} Client;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int open_connection(const struct sockaddr_in* to) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct timeval timeout = { 10, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(sock, (const struct sockaddr*)to, sizeof(*to)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Reads one response off `sock` and throws the body away. Returns its status
+   code, or -1 when the connection failed first; `*answered` tells whether
+   any of it arrived, `*closing` whether the connection ends with it. */
+int read_response(int sock, int* answered, int* closing) {
+    char head[HEAD_MAX + 1];
+    size_t len = 0;
+    char* end = NULL;
+    *answered = 0;
+    *closing = 0;
+    while (!end) {
+        if (len == HEAD_MAX) return -1;
+        int got = recv(sock, head + len, HEAD_MAX - len, 0);
+        if (got <= 0) return -1;
+        *answered = 1;
+        len += got;
+        head[len] = '\0';
+        end = strstr(head, "\r\n\r\n");
+    }
+    int status = 0;
+    if (sscanf(head, "HTTP/%*d.%*d %d", &status) != 1) return -1;
+    const char* connection = strcasestr(head, "\r\nConnection:");
+    if (connection && connection < end && strncasecmp(connection + 13 + strspn(connection + 13, " "), "close", 5) == 0)
+        *closing = 1;
+
+    long long left = -1;
+    const char* length = strcasestr(head, "\r\nContent-Length:");
+    if (length && length < end) left = atoll(length + 17);
+    else *closing = 1; /* the body runs to the end of the connection */
+    if (left >= 0) left -= (long long)(len - (end + 4 - head));
+    char discard[65536];
+    while (left != 0) {
+        int got = recv(sock, discard, left < 0 || left > (long long)sizeof(discard) ? sizeof(discard) : (size_t)left, 0);
+        if (got == 0 && left < 0) break;
+        if (got <= 0) return -1;
+        if (left > 0) left -= got;
+    }
+    return status;
+}
+
+/* Sends a request for `path` on `*sock`, opening one when it is -1, and
+   reads the answer; its status, or -1. */
+int request(Client* c, int* sock, const char* path) {
+    char req[1024];
+    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: httpbench\r\nConnection: %s\r\n\r\n", path,
+             c->keepalive ? "keep-alive" : "close");
+    /* A reused connection may have been closed meanwhile; that request goes
+       again, once, on a new one. */
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = *sock >= 0;
+        if (!reused && (*sock = open_connection(&c->to)) < 0) return -1;
+        int answered = 0, closing = 1, status = -1;
+        if (send(*sock, req, strlen(req), MSG_NOSIGNAL) == (ssize_t)strlen(req)) {
+            status = read_response(*sock, &answered, &closing);
+        }
+        if (status < 0 || closing || !c->keepalive) {
+            close(*sock);
+            *sock = -1;
+        }
+        if (status >= 0) {
+            if (reused) c->reused++;
+            return status;
+        }
+        if (!reused || answered) return -1;
+    }
+    return -1;
+}
+
+void note(Client* c, int path, long long us) {
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 4096;
+        c->latency = (long long*)realloc(c->latency, c->capacity * sizeof(long long));
+        c->which = (unsigned char*)realloc(c->which, c->capacity);
+        if (!c->latency || !c->which) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    c->latency[c->count] = us;
+    c->which[c->count++] = (unsigned char)path;
+}
+
+void* run_client(void* arg) {
+    Client* c = (Client*)arg;
+    int sock = -1;
+    for (int i = c->index % c->paths; now_ns() < c->stop; i = (i + 1) % c->paths) {
+        long long started = now_ns();
+        int status = request(c, &sock, c->path[i]);
+        if (status != 200) c->errors[i]++;
+        else note(c, i, (now_ns() - started) / 1000);
+    }
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile_ms(const long long* sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p / 100 * (n - 1) + 0.5);
+    return sorted[i] / 1e3;
+}
+
+void report(const char* name, long long* us, size_t n, unsigned long long errors, double seconds) {
+    qsort(us, n, sizeof(long long), compare_ll);
+    printf("  %-34s %9zu %9.1f %8.2f %8.2f %8.2f %8.2f %7llu\n", name, n, n / seconds, percentile_ms(us, n, 50),
+           percentile_ms(us, n, 99), percentile_ms(us, n, 99.9), n ? us[n - 1] / 1e3 : 0.0, errors);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        printf("usage: httpbench <IP> <HTTP_PORT> [-connections C] [-seconds S] [-keepalive] [-paths P[,P...]]\n"
+               "                 [-udp PORT -rate R [-binary] [-bin DIR]]\n");
+        printf("  -connections C: clients at once, each on a thread (default 16, at most %d)\n", MAX_CONNECTIONS);
+        printf("  -seconds S: how long to run (default 10)\n");
+        printf("  -keepalive: reuse connections instead of opening one per request\n");
+        printf("  -paths P,...: what to ask for, in turn (default /, /api/stats, /api/sensors,\n"
+               "               /api/percentiles?seconds=3600, /api/aggregate?fn=p99; at most %d)\n", MAX_PATHS);
+        printf("  -udp PORT -rate R: meanwhile run loadgen at R readings/s against the UDP port\n");
+        printf("  -binary: loadgen sends numbered binary datagrams\n");
+        printf("  -bin DIR: where loadgen is (default: next to httpbench)\n");
+        return 1;
+    }
+    const char* ip = argv[1];
+    int port = atoi(argv[2]);
+    int connections = 16, keepalive = 0, udp_port = 0, binary = 0;
+    double seconds = 10, rate = 0;
+    const char* bin = NULL;
+    char default_paths[] = "/,/api/stats,/api/sensors,/api/percentiles?seconds=3600,/api/aggregate?fn=p99";
+    char* path_list = default_paths;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-connections") == 0 && i + 1 < argc) connections = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-seconds") == 0 && i + 1 < argc) seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "-keepalive") == 0) keepalive = 1;
+        else if (strcmp(argv[i], "-paths") == 0 && i + 1 < argc) path_list = argv[++i];
+        else if (strcmp(argv[i], "-udp") == 0 && i + 1 < argc) udp_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc) rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-binary") == 0) binary = 1;
+        else if (strcmp(argv[i], "-bin") == 0 && i + 1 < argc) bin = argv[++i];
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (connections < 1 || connections > MAX_CONNECTIONS || seconds <= 0 || (udp_port > 0) != (rate > 0)) {
+        printf("Bad -connections or -seconds, or -udp without -rate\n");
+        return 1;
+    }
+    char* paths[MAX_PATHS];
+    int path_count = 0;
+    for (char* p = strtok(path_list, ","); p && path_count < MAX_PATHS; p = strtok(NULL, ",")) paths[path_count++] = p;
+    if (path_count == 0) {
+        printf("Bad -paths\n");
+        return 1;
+    }
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &to.sin_addr) != 1) {
+        printf("Bad IP %s\n", ip);
+        return 1;
+    }
+    int probe = open_connection(&to);
+    if (probe < 0) {
+        printf("Can't connect to %s:%d\n", ip, port);
+        return 1;
+    }
+    close(probe);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* loadgen runs a little longer than the benchmark, so the load is on
+       before the first request and still on after the last. */
+    pid_t loadgen_pid = -1;
+    if (udp_port > 0) {
+        char dir_bin[512], loadgen[1100], udp[16], rate_arg[32], seconds_arg[32];
+        if (!bin) {
+            snprintf(dir_bin, sizeof(dir_bin), "%s", argv[0]);
+            char* slash = strrchr(dir_bin, '/');
+            if (slash) *slash = '\0';
+            else snprintf(dir_bin, sizeof(dir_bin), ".");
+            bin = dir_bin;
+        }
+        snprintf(loadgen, sizeof(loadgen), "%s/loadgen", bin);
+        if (access(loadgen, X_OK) != 0) {
+            printf("Need loadgen in %s (see -bin)\n", bin);
+            return 1;
+        }
+        snprintf(udp, sizeof(udp), "%d", udp_port);
+        snprintf(rate_arg, sizeof(rate_arg), "%g", rate);
+        snprintf(seconds_arg, sizeof(seconds_arg), "%g", seconds + 1);
+        char* loadgen_argv[] = { loadgen, (char*)ip, udp, (char*)"-rate", rate_arg, (char*)"-seconds", seconds_arg,
+                                 (char*)"-http", (char*)"0", binary ? (char*)"-binary" : NULL, NULL };
+        fflush(stdout);
+        loadgen_pid = fork();
+        if (loadgen_pid == 0) {
+            execv(loadgen, loadgen_argv);
+            _exit(127);
+        }
+        usleep(500 * 1000);
+    }
+
+    printf("Running %d connection(s) for %g s, %s%s\n", connections, seconds,
+           keepalive ? "keep-alive" : "a connection per request", udp_port > 0 ? ", under UDP load" : "");
+    fflush(stdout);
+    static Client clients[MAX_CONNECTIONS];
+    pthread_t ids[MAX_CONNECTIONS];
+    long long started = now_ns();
+    for (int i = 0; i < connections; i++) {
+        Client* c = &clients[i];
+        c->to = to;
+        c->index = i;
+        c->keepalive = keepalive;
+        c->paths = path_count;
+        c->path = paths;
+        c->stop = started + (long long)(seconds * 1e9);
+        if (pthread_create(&ids[i], NULL, run_client, c) != 0) {
+            printf("Can't start connection %d\n", i + 1);
+            return 1;
+        }
+    }
+    for (int i = 0; i < connections; i++) pthread_join(ids[i], NULL);
+    double took = (now_ns() - started) / 1e9;
+    if (loadgen_pid > 0) waitpid(loadgen_pid, NULL, 0);
+
+    size_t total = 0;
+    unsigned long long reused = 0;
+    for (int i = 0; i < connections; i++) {
+        total += clients[i].count;
+        reused += clients[i].reused;
+    }
+    long long* all = (long long*)malloc((total + 1) * sizeof(long long));
+    long long* one = (long long*)malloc((total + 1) * sizeof(long long));
+    printf("  %-34s %9s %9s %8s %8s %8s %8s %7s\n", "path", "requests", "req/s", "p50 ms", "p99", "p99.9", "max",
+           "errors");
+    unsigned long long all_errors = 0;
+    size_t n_all = 0;
+    for (int p = 0; p < path_count; p++) {
+        size_t n = 0;
+        unsigned long long errors = 0;
+        for (int i = 0; i < connections; i++) {
+            Client* c = &clients[i];
+            errors += c->errors[p];
+            for (size_t k = 0; k < c->count; k++) {
+                if (c->which[k] == p) one[n++] = c->latency[k];
+            }
+        }
+        memcpy(all + n_all, one, n * sizeof(long long));
+        n_all += n;
+        all_errors += errors;
+        report(paths[p], one, n, errors, took);
+    }
+    report("all", all, n_all, all_errors, took);
+    if (keepalive) printf("  %llu of %zu requests reused a connection\n", reused, total);
+
+    for (int i = 0; i < connections; i++) {
+        free(clients[i].latency);
+        free(clients[i].which);
+    }
+    free(all);
+    free(one);
+    return 0;
+}
@@ -0,0 +1,307 @@
+/* UDP load generator: sends readings straight to the server's port, with no
+   serial link or sender in between, to find out how many it can take.
+
+   Each thread sends its share of the target rate with sendmmsg, keeping to
+   a schedule of absolute deadlines, so the average rate is exact and a
+   burst is never more than one call's worth; -max drops the schedule and
+   sends as fast as the socket takes them. Readings carry sensor ids over a
+   range, as many senders would, as text ("ID:value" lines) or as numbered
+   binary datagrams (-binary, PROTO_STREAM).
+
+   Given several rates, it runs one step per rate and asks the server
+   (/api/stats) after each how many readings it received, which makes the
+   loss curve. The counts are server-wide, so nothing else should send to it
+   meanwhile. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+#define MAX_THREADS 64
+#define MAX_RATES 32
+#define MAX_PER 1000
+#define BATCH 64        /* datagrams per sendmmsg */
+#define TEXT_LINE 24    /* room for "ID:value\n" */
+
+typedef struct {
+    /* settings, the same for every thread */
+    struct sockaddr_in to;
+    int index, threads, sensors, first, per, binary;
+    double rate;        /* readings per second for this thread, 0 for as fast as possible */
+    long long start, stop; /* ns */
+    uint32_t sender;
+    /* carried from step to step */
+    uint64_t seq;
+    unsigned long long reading;
+    /* results of the step */
+    unsigned long long sent, errors;
+} Worker;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+long long wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_until_ns(long long deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    int rc;
+    while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR) {}
+    if (rc != 0) {
+        printf("clock_nanosleep failed: %s\n", strerror(rc));
+        exit(1);
+    }
+}
+
+/* Fills `buf` with the next datagram of `w`; returns its size. */
+int make_datagram(Worker* w, unsigned char* buf, long long time_us) {
+    int len = 0;
+    if (w->binary) {
+        ProtoHeader h = { PROTO_STREAM, (uint16_t)w->per, w->sender, w->seq, 0, time_us, 0 };
+        proto_write_header(buf, &h);
+        len = PROTO_HEADER;
+        w->seq += w->per;
+    }
+    for (int i = 0; i < w->per; i++) {
+        unsigned long long k = w->reading++;
+        int sensor = w->first + (int)((k * w->threads + w->index) % w->sensors);
+        float value = 15.0f + (float)(k % 1000) / 100;
+        if (w->binary) {
+            proto_write_reading(buf + len, sensor, value, time_us, 0);
+            len += PROTO_READING;
+        } else {
+            len += snprintf((char*)buf + len, TEXT_LINE, "%d:%.2f\n", sensor, value);
+        }
+    }
+    return len;
+}
+
+void* run_worker(void* arg) {
+    Worker* w = (Worker*)arg;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return NULL;
+    int size = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (connect(sock, (struct sockaddr*)&w->to, sizeof(w->to)) != 0) {
+        close(sock);
+        return NULL;
+    }
+
+    int max_len = w->binary ? PROTO_HEADER + w->per * PROTO_READING : w->per * TEXT_LINE;
+    unsigned char* bufs = (unsigned char*)malloc((size_t)BATCH * max_len);
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++) {
+        iov[i].iov_base = bufs + (size_t)i * max_len;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Datagram n is due at start + n / per_second. */
+    double per_second = w->rate / w->per;
+    long long start = w->start;
+    unsigned long long datagrams = 0;
+    while (1) {
+        long long now = now_ns();
+        if (now >= w->stop) break;
+        int n = BATCH;
+        if (per_second > 0) {
+            unsigned long long due = (unsigned long long)((now - start) / 1e9 * per_second) + 1;
+            if (due <= datagrams) {
+                long long next = start + (long long)(datagrams / per_second * 1e9);
+                sleep_until_ns(next < w->stop ? next : w->stop);
+                continue;
+            }
+            if (due - datagrams < (unsigned long long)n) n = (int)(due - datagrams);
+        }
+        long long time_us = wall_us();
+        for (int i = 0; i < n; i++) iov[i].iov_len = make_datagram(w, (unsigned char*)iov[i].iov_base, time_us);
+        /* Whatever the socket refuses is counted and skipped, not retried:
+           the schedule goes on as a real sender's would. */
+        for (int done = 0; done < n;) {
+            int got = sendmmsg(sock, msgs + done, n - done, 0);
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                w->errors++;
+                got = 1;
+            } else {
+                w->sent += (unsigned long long)got * w->per;
+            }
+            done += got;
+        }
+        datagrams += n;
+    }
+    free(bufs);
+    close(sock);
+    return NULL;
+}
+
+/* Readings the server says it received (numbered and not), or -1 when it
+   can't be asked. */
+long long server_received(const char* ip, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct timeval timeout = { 5, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    const char* request = "GET /api/stats HTTP/1.1\r\nHost: loadgen\r\nConnection: close\r\n\r\n";
+    if (send(sock, request, strlen(request), 0) < 0) {
+        close(sock);
+        return -1;
+    }
+    static char response[1 << 20];
+    size_t len = 0;
+    int got;
+    while (len < sizeof(response) - 1 && (got = recv(sock, response + len, sizeof(response) - 1 - len, 0)) > 0)
+        len += got;
+    close(sock);
+    response[len] = '\0';
+
+    /* The totals come right after "unnumbered", before any per-sender counts. */
+    char* unnumbered = strstr(response, "\"unnumbered\":");
+    char* received = unnumbered ? strstr(unnumbered, "\"received\":") : NULL;
+    if (!received) return -1;
+    return atoll(unnumbered + 13) + atoll(received + 11);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        printf("usage: loadgen <IP> <PORT> [-rate R[,R...] | -max] [-seconds S] [-threads T] [-sensors N]\n"
+               "               [-first ID] [-per N] [-binary] [-http PORT]\n");
+        printf("  -rate R[,R...]: readings per second in all, one step per rate (default 10000)\n");
+        printf("  -max: send as fast as possible instead\n");
+        printf("  -seconds S: length of each step (default 5)\n");
+        printf("  -threads T: sending threads, each with its own socket (default 1, at most %d)\n", MAX_THREADS);
+        printf("  -sensors N, -first ID: sensor ids the readings cycle through (default 1000 from 1)\n");
+        printf("  -per N: readings per datagram (default 1, at most %d)\n", MAX_PER);
+        printf("  -binary: numbered binary datagrams instead of text lines\n");
+        printf("  -http PORT: where to ask the server for its counts (default PORT + 1, 0 for not at all)\n");
+        return 1;
+    }
+    const char* ip = argv[1];
+    int port = atoi(argv[2]);
+    double rates[MAX_RATES];
+    int steps = 1, threads = 1, sensors = 1000, first = 1, per = 1, binary = 0, http = port + 1;
+    double seconds = 5;
+    rates[0] = 10000;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc) {
+            char* p = argv[++i];
+            for (steps = 0; *p && steps < MAX_RATES; steps++) {
+                rates[steps] = strtod(p, &p);
+                if (*p == ',') p++;
+            }
+        } else if (strcmp(argv[i], "-max") == 0) {
+            rates[0] = 0;
+            steps = 1;
+        } else if (strcmp(argv[i], "-seconds") == 0 && i + 1 < argc) seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-sensors") == 0 && i + 1 < argc) sensors = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-first") == 0 && i + 1 < argc) first = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-per") == 0 && i + 1 < argc) per = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-binary") == 0) binary = 1;
+        else if (strcmp(argv[i], "-http") == 0 && i + 1 < argc) http = atoi(argv[++i]);
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || sensors < 1 || per < 1 || per > MAX_PER || seconds <= 0) {
+        printf("Bad -threads, -sensors, -per or -seconds\n");
+        return 1;
+    }
+    for (int i = 0; i < steps; i++) {
+        if (rates[i] < 0 || (rates[i] == 0 && steps > 1)) {
+            printf("Bad -rate\n");
+            return 1;
+        }
+    }
+
+    static Worker workers[MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    srand((unsigned)(time(NULL) ^ getpid()));
+    for (int t = 0; t < threads; t++) {
+        Worker* w = &workers[t];
+        w->to.sin_family = AF_INET;
+        w->to.sin_port = htons(port);
+        if (inet_pton(AF_INET, ip, &w->to.sin_addr) != 1) {
+            printf("Bad IP %s\n", ip);
+            return 1;
+        }
+        w->index = t;
+        w->threads = threads;
+        w->sensors = sensors;
+        w->first = first;
+        w->per = per;
+        w->binary = binary;
+        w->sender = ((uint32_t)rand() << 16 ^ (uint32_t)rand()) + t;
+    }
+
+    long long received = http > 0 ? server_received(ip, http) : -1;
+    if (http > 0 && received < 0) printf("Can't get counts from %s:%d, reporting what was sent only\n", ip, http);
+    printf("Sending to %s:%d: %d thread(s), %d sensors, %s, %d reading(s) per datagram, %g s per step\n", ip, port,
+           threads, sensors, binary ? "binary" : "text", per, seconds);
+    printf("%12s %14s %12s %12s %12s %8s\n", "target/s", "achieved/s", "sent", "received", "lost", "loss");
+
+    for (int s = 0; s < steps; s++) {
+        pthread_t ids[MAX_THREADS];
+        long long started = now_ns();
+        for (int t = 0; t < threads; t++) {
+            workers[t].rate = rates[s] / threads;
+            workers[t].start = started;
+            workers[t].stop = started + (long long)(seconds * 1e9);
+            workers[t].sent = workers[t].errors = 0;
+            pthread_create(&ids[t], NULL, run_worker, &workers[t]);
+        }
+        unsigned long long sent = 0, errors = 0;
+        for (int t = 0; t < threads; t++) {
+            pthread_join(ids[t], NULL);
+            sent += workers[t].sent;
+            errors += workers[t].errors;
+        }
+        double took = (now_ns() - started) / 1e9;
+
+        char target[32] = "max";
+        if (rates[s] > 0) snprintf(target, sizeof(target), "%.0f", rates[s]);
+        printf("%12s %14.1f %12llu", target, sent / took, sent);
+        if (received >= 0) {
+            usleep(500 * 1000); /* let the server drain its socket */
+            long long now = server_received(ip, http);
+            if (now >= 0) {
+                long long got = now - received, lost = (long long)sent - got;
+                printf(" %12lld %12lld %7.2f%%", got, lost, sent ? 100.0 * lost / sent : 0.0);
+                received = now;
+            }
+        }
+        if (errors) printf("  (%llu send errors)", errors);
+        printf("\n");
+        fflush(stdout);
+    }
+    return 0;
+}
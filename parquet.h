@@ -0,0 +1,775 @@
+#ifndef PARQUET_H
+#define PARQUET_H
+
+// Just enough Parquet to write and read back the archive files: four required
+// columns, `time` (INT64, TIMESTAMP millis UTC), `temp` (DOUBLE), `repeats`
+// and `sensor` (INT64, see Sample), no compression codec. Times, repeats and
+// sensors use DELTA_BINARY_PACKED, which shrinks a steady cadence to a few
+// bits per row and a column of zeros to almost nothing; temperatures are
+// dictionary encoded, since a day at 0.01 °C resolution rarely has more than
+// a few thousand distinct values. Every column chunk carries min/max
+// statistics so readers (ours, pandas, DuckDB) can skip row groups by time.
+// Metadata is Thrift compact protocol, written and parsed by hand.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+namespace parquet {
+
+enum { T_BOOL_TRUE = 1, T_BOOL_FALSE = 2, T_BYTE = 3, T_I16 = 4, T_I32 = 5, T_I64 = 6, T_DOUBLE = 7,
+       T_BINARY = 8, T_LIST = 9, T_SET = 10, T_MAP = 11, T_STRUCT = 12 };
+enum { INT64 = 2, DOUBLE = 5 };
+enum { PLAIN = 0, PLAIN_DICTIONARY = 2, RLE = 3, DELTA_BINARY_PACKED = 5, RLE_DICTIONARY = 8 };
+enum { DATA_PAGE = 0, DICTIONARY_PAGE = 2 };
+
+const int DELTA_BLOCK = 128;
+const int DELTA_MINIBLOCKS = 4;
+const size_t MAX_DICTIONARY = 1 << 16;
+
+inline void PutUleb(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+inline void PutZigzag(std::string& out, int64_t v) { PutUleb(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+
+inline std::string LittleEndian(uint64_t v) {
+    std::string out(8, '\0');
+    for (int i = 0; i < 8; i++) out[i] = (char)(v >> (8 * i));
+    return out;
+}
+
+inline uint64_t FromLittleEndian(const std::string& s) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < 8 && i < s.size(); i++) v |= (uint64_t)(uint8_t)s[i] << (8 * i);
+    return v;
+}
+
+inline std::string PlainDouble(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    return LittleEndian(bits);
+}
+
+// Thrift compact protocol, the subset Parquet metadata needs.
+class ThriftWriter {
+public:
+    std::string out;
+    std::vector<int> stack;
+    int field;
+
+    ThriftWriter() : field(0) {}
+
+    void Header(int type, int id) {
+        if (id > field && id - field <= 15) {
+            out.push_back((char)(((id - field) << 4) | type));
+        } else {
+            out.push_back((char)type);
+            PutZigzag(out, id);
+        }
+        field = id;
+    }
+    void I32(int id, int64_t v) { Header(T_I32, id); PutZigzag(out, v); }
+    void I64(int id, int64_t v) { Header(T_I64, id); PutZigzag(out, v); }
+    void Bool(int id, bool v) { Header(v ? T_BOOL_TRUE : T_BOOL_FALSE, id); }
+    void Binary(int id, const std::string& s) { Header(T_BINARY, id); PutUleb(out, s.size()); out += s; }
+    void Begin(int id) { Header(T_STRUCT, id); Open(); }
+    void List(int id, int type, size_t size) {
+        Header(T_LIST, id);
+        if (size < 15) {
+            out.push_back((char)((size << 4) | type));
+        } else {
+            out.push_back((char)(0xF0 | type));
+            PutUleb(out, size);
+        }
+    }
+    // A struct that is a list element or the top level has no field header.
+    void Open() { stack.push_back(field); field = 0; }
+    void End() { out.push_back(0); field = stack.back(); stack.pop_back(); }
+};
+
+class ThriftReader {
+public:
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok;
+    std::vector<int> stack;
+    int field;
+
+    ThriftReader(const void* data, size_t size)
+        : p((const uint8_t*)data), end((const uint8_t*)data + size), ok(true), field(0) {}
+
+    uint64_t Uleb() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p >= end) break;
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+    int64_t Zigzag() { uint64_t v = Uleb(); return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+    // Next field of the current struct; false at its end.
+    bool Next(int& type, int& id) {
+        if (!ok || p >= end) { ok = false; return false; }
+        uint8_t b = *p++;
+        if (b == 0) return false;
+        type = b & 0x0f;
+        id = (b >> 4) ? field + (b >> 4) : (int)Zigzag();
+        field = id;
+        return ok;
+    }
+    void Open() { stack.push_back(field); field = 0; }
+    void Close() { field = stack.back(); stack.pop_back(); }
+
+    std::string Binary() {
+        uint64_t n = Uleb();
+        if (!ok || n > (uint64_t)(end - p)) { ok = false; return ""; }
+        std::string s((const char*)p, (size_t)n);
+        p += n;
+        return s;
+    }
+    size_t ListHeader(int& type) {
+        if (p >= end) { ok = false; return 0; }
+        uint8_t b = *p++;
+        type = b & 0x0f;
+        size_t n = b >> 4;
+        if (n == 15) n = (size_t)Uleb();
+        return n;
+    }
+    void Skip(int type) {
+        switch (type) {
+        case T_BOOL_TRUE: case T_BOOL_FALSE: break;
+        case T_BYTE: p++; break;
+        case T_I16: case T_I32: case T_I64: Uleb(); break;
+        case T_DOUBLE: p += 8; break;
+        case T_BINARY: Binary(); break;
+        case T_LIST: case T_SET: {
+            int elem;
+            size_t n = ListHeader(elem);
+            for (size_t i = 0; ok && i < n; i++) {
+                if (elem == T_BOOL_TRUE || elem == T_BOOL_FALSE) p++;
+                else Skip(elem);
+            }
+            break;
+        }
+        case T_MAP: {
+            size_t n = (size_t)Uleb();
+            if (n == 0) break;
+            if (p >= end) { ok = false; break; }
+            uint8_t kv = *p++;
+            for (size_t i = 0; ok && i < n; i++) {
+                Skip(kv >> 4);
+                Skip(kv & 0x0f);
+            }
+            break;
+        }
+        case T_STRUCT: {
+            int t, id;
+            Open();
+            while (Next(t, id)) Skip(t);
+            Close();
+            break;
+        }
+        default: ok = false;
+        }
+        if (p > end) ok = false;
+    }
+};
+
+// Appends `bits` low bits of each value, least significant bit first.
+inline void PackBits(std::string& out, const uint64_t* values, size_t count, int bits) {
+    size_t base = out.size();
+    out.append((count * bits + 7) / 8, '\0');
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (int b = 0; b < bits; b++, pos++) {
+            if ((values[i] >> b) & 1) out[base + pos / 8] |= (char)(1 << (pos % 8));
+        }
+    }
+}
+
+inline int BitWidth(uint64_t v) {
+    int bits = 0;
+    while (v) { bits++; v >>= 1; }
+    return bits;
+}
+
+inline std::string EncodeDeltas(const std::vector<int64_t>& values) {
+    std::string out;
+    PutUleb(out, DELTA_BLOCK);
+    PutUleb(out, DELTA_MINIBLOCKS);
+    PutUleb(out, values.size());
+    PutZigzag(out, values.empty() ? 0 : values[0]);
+    const int per_mini = DELTA_BLOCK / DELTA_MINIBLOCKS;
+    std::vector<uint64_t> deltas;
+    for (size_t start = 1; start < values.size(); start += DELTA_BLOCK) {
+        size_t n = std::min<size_t>(DELTA_BLOCK, values.size() - start);
+        deltas.assign(n, 0);
+        int64_t min_delta = INT64_MAX;
+        for (size_t i = 0; i < n; i++) {
+            int64_t d = (int64_t)((uint64_t)values[start + i] - (uint64_t)values[start + i - 1]);
+            deltas[i] = (uint64_t)d;
+            min_delta = std::min(min_delta, d);
+        }
+        for (size_t i = 0; i < n; i++) deltas[i] -= (uint64_t)min_delta;
+        PutZigzag(out, min_delta);
+
+        int widths[DELTA_MINIBLOCKS] = { 0 };
+        for (size_t i = 0; i < n; i++) widths[i / per_mini] = std::max(widths[i / per_mini], BitWidth(deltas[i]));
+        for (int m = 0; m < DELTA_MINIBLOCKS; m++) out.push_back((char)widths[m]);
+        deltas.resize(DELTA_BLOCK, 0);
+        for (int m = 0; m < DELTA_MINIBLOCKS && (size_t)(m * per_mini) < n; m++) {
+            PackBits(out, &deltas[m * per_mini], per_mini, widths[m]);
+        }
+    }
+    return out;
+}
+
+class BitUnpacker {
+public:
+    const uint8_t* p;
+    const uint8_t* end;
+    uint64_t acc;
+    int have;
+
+    BitUnpacker(const uint8_t* begin, const uint8_t* stop) : p(begin), end(stop), acc(0), have(0) {}
+
+    bool Get(int bits, uint64_t& v) {
+        v = 0;
+        int got = 0;
+        while (got < bits) {
+            if (have == 0) {
+                if (p >= end) return false;
+                acc = *p++;
+                have = 8;
+            }
+            int take = std::min(bits - got, have);
+            v |= (acc & ((1ULL << take) - 1)) << got;
+            acc >>= take;
+            have -= take;
+            got += take;
+        }
+        return true;
+    }
+};
+
+inline bool DecodeDeltas(const uint8_t*& p, const uint8_t* end, size_t count, std::vector<int64_t>& out) {
+    ThriftReader r(p, end - p);
+    uint64_t block = r.Uleb(), minis = r.Uleb(), total = r.Uleb();
+    int64_t value = r.Zigzag();
+    if (!r.ok || minis == 0 || block % minis != 0 || (block / minis) % 8 != 0 || total < count) return false;
+    uint64_t per_mini = block / minis;
+    if (count > 0) out.push_back(value);
+    size_t done = count > 0 ? 1 : 0;
+    while (done < total) {
+        int64_t min_delta = r.Zigzag();
+        if (!r.ok || (uint64_t)(end - r.p) < minis) return false;
+        std::vector<int> widths(r.p, r.p + minis);
+        r.p += minis;
+        for (uint64_t m = 0; m < minis && done < total; m++) {
+            if (widths[m] > 64) return false;
+            size_t bytes = (size_t)(per_mini * widths[m] / 8);
+            if ((size_t)(end - r.p) < bytes) return false;
+            BitUnpacker bits(r.p, r.p + bytes);
+            for (uint64_t i = 0; i < per_mini && done < total; i++, done++) {
+                uint64_t d;
+                bits.Get(widths[m], d);
+                value = (int64_t)((uint64_t)value + d + (uint64_t)min_delta);
+                if (done < count) out.push_back(value);
+            }
+            r.p += bytes;
+        }
+    }
+    p = r.p;
+    return true;
+}
+
+// RLE / bit-packed hybrid: writes everything as bit-packed runs of 8.
+inline void EncodeHybrid(std::string& out, const std::vector<uint64_t>& values, int bits) {
+    const size_t MAX_GROUPS = 63; // keeps each run header one byte
+    for (size_t start = 0; start < values.size(); start += MAX_GROUPS * 8) {
+        size_t n = std::min(values.size() - start, MAX_GROUPS * 8);
+        size_t groups = (n + 7) / 8;
+        PutUleb(out, (groups << 1) | 1);
+        std::vector<uint64_t> run(values.begin() + start, values.begin() + start + n);
+        run.resize(groups * 8, 0);
+        PackBits(out, &run[0], run.size(), bits);
+    }
+}
+
+inline bool DecodeHybrid(const uint8_t* p, const uint8_t* end, int bits, size_t count, std::vector<uint32_t>& out) {
+    ThriftReader r(p, end - p);
+    size_t bytes_per_value = (bits + 7) / 8;
+    while (out.size() < count) {
+        uint64_t header = r.Uleb();
+        if (!r.ok) return false;
+        if (header & 1) {
+            size_t n = (size_t)(header >> 1) * 8;
+            size_t bytes = n * bits / 8;
+            if ((size_t)(end - r.p) < bytes) return false;
+            BitUnpacker unpack(r.p, r.p + bytes);
+            for (size_t i = 0; i < n && out.size() < count; i++) {
+                uint64_t v;
+                unpack.Get(bits, v);
+                out.push_back((uint32_t)v);
+            }
+            r.p += bytes;
+        } else {
+            if ((size_t)(end - r.p) < bytes_per_value) return false;
+            uint64_t v = 0;
+            for (size_t i = 0; i < bytes_per_value; i++) v |= (uint64_t)r.p[i] << (8 * i);
+            r.p += bytes_per_value;
+            for (size_t i = 0; i < (size_t)(header >> 1) && out.size() < count; i++) out.push_back((uint32_t)v);
+        }
+    }
+    return true;
+}
+
+struct ColumnInfo {
+    int64_t offset;      // first page, the dictionary's when there is one
+    int64_t data_offset; // first data page
+    int64_t size;
+    int64_t values;
+    std::string min, max; // plain encoded
+    int encoding;         // of the data pages
+};
+
+struct RowGroupInfo {
+    int64_t rows;
+    int64_t min_time, max_time;
+    ColumnInfo time, temp, repeats, sensor; // size < 0 when the file has no such column
+};
+
+inline void WritePageHeader(ThriftWriter& w, int type, size_t size, size_t values, int encoding) {
+    w.Open();
+    w.I32(1, type);
+    w.I32(2, (int64_t)size);
+    w.I32(3, (int64_t)size);
+    if (type == DATA_PAGE) {
+        w.Begin(5);
+        w.I32(1, (int64_t)values);
+        w.I32(2, encoding);
+        w.I32(3, RLE);
+        w.I32(4, RLE);
+        w.End();
+    } else {
+        w.Begin(7);
+        w.I32(1, (int64_t)values);
+        w.I32(2, encoding);
+        w.End();
+    }
+    w.End();
+}
+
+class Writer {
+public:
+    FILE* out;
+    int64_t offset;
+    std::vector<RowGroupInfo> groups;
+
+    Writer() : out(nullptr), offset(0) {}
+    ~Writer() { if (out) fclose(out); }
+
+    bool Open(const std::string& path) {
+        out = fopen(path.c_str(), "wb");
+        return out && Put("PAR1");
+    }
+
+    bool Put(const std::string& bytes) {
+        offset += bytes.size();
+        return fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+    }
+
+    bool Page(int type, const std::string& body, size_t values, int encoding) {
+        ThriftWriter header;
+        WritePageHeader(header, type, body.size(), values, encoding);
+        return Put(header.out) && Put(body);
+    }
+
+    // A delta-encoded INT64 column chunk.
+    bool WriteInts(ColumnInfo& c, const std::vector<int64_t>& values) {
+        c.offset = c.data_offset = offset;
+        c.encoding = DELTA_BINARY_PACKED;
+        c.values = (int64_t)values.size();
+        c.min = LittleEndian((uint64_t)*std::min_element(values.begin(), values.end()));
+        c.max = LittleEndian((uint64_t)*std::max_element(values.begin(), values.end()));
+        if (!Page(DATA_PAGE, EncodeDeltas(values), values.size(), DELTA_BINARY_PACKED)) return false;
+        c.size = offset - c.offset;
+        return true;
+    }
+
+    // `times` ascending epoch ms, `temps` in degrees.
+    bool WriteRowGroup(const std::vector<int64_t>& times, const std::vector<double>& temps,
+                       const std::vector<int64_t>& repeats, const std::vector<int64_t>& sensors) {
+        if (times.empty()) return true;
+        RowGroupInfo g;
+        g.rows = (int64_t)times.size();
+        g.min_time = *std::min_element(times.begin(), times.end());
+        g.max_time = *std::max_element(times.begin(), times.end());
+
+        g.time.offset = g.time.data_offset = offset;
+        g.time.encoding = DELTA_BINARY_PACKED;
+        g.time.values = g.rows;
+        g.time.min = LittleEndian((uint64_t)g.min_time);
+        g.time.max = LittleEndian((uint64_t)g.max_time);
+        if (!Page(DATA_PAGE, EncodeDeltas(times), times.size(), DELTA_BINARY_PACKED)) return false;
+        g.time.size = offset - g.time.offset;
+
+        std::map<double, uint64_t> dictionary;
+        for (size_t i = 0; i < temps.size() && dictionary.size() <= MAX_DICTIONARY; i++) dictionary[temps[i]] = 0;
+        g.temp.offset = g.temp.data_offset = offset;
+        g.temp.values = g.rows;
+        g.temp.min = PlainDouble(*std::min_element(temps.begin(), temps.end()));
+        g.temp.max = PlainDouble(*std::max_element(temps.begin(), temps.end()));
+        g.temp.encoding = PLAIN;
+        if (dictionary.size() <= MAX_DICTIONARY) {
+            std::string dict;
+            uint64_t index = 0;
+            for (std::map<double, uint64_t>::iterator it = dictionary.begin(); it != dictionary.end(); ++it) {
+                it->second = index++;
+                dict += PlainDouble(it->first);
+            }
+            if (!Page(DICTIONARY_PAGE, dict, dictionary.size(), PLAIN_DICTIONARY)) return false;
+            g.temp.data_offset = offset;
+            int bits = std::max(1, BitWidth(dictionary.size() - 1));
+            std::vector<uint64_t> indices(temps.size());
+            for (size_t i = 0; i < temps.size(); i++) indices[i] = dictionary[temps[i]];
+            std::string body(1, (char)bits);
+            EncodeHybrid(body, indices, bits);
+            g.temp.encoding = RLE_DICTIONARY;
+            if (!Page(DATA_PAGE, body, temps.size(), RLE_DICTIONARY)) return false;
+        } else {
+            std::string body;
+            for (size_t i = 0; i < temps.size(); i++) body += PlainDouble(temps[i]);
+            if (!Page(DATA_PAGE, body, temps.size(), PLAIN)) return false;
+        }
+        g.temp.size = offset - g.temp.offset;
+
+        if (!WriteInts(g.repeats, repeats) || !WriteInts(g.sensor, sensors)) return false;
+        groups.push_back(g);
+        return true;
+    }
+
+    void WriteColumn(ThriftWriter& w, const ColumnInfo& c, const char* name, int type) {
+        w.Open(); // ColumnChunk
+        w.I64(2, c.offset);
+        w.Begin(3);
+        w.I32(1, type);
+        bool dictionary = (c.encoding == RLE_DICTIONARY);
+        w.List(2, T_I32, dictionary ? 3 : 2);
+        PutZigzag(w.out, c.encoding);
+        PutZigzag(w.out, RLE);
+        if (dictionary) PutZigzag(w.out, PLAIN);
+        w.List(3, T_BINARY, 1);
+        PutUleb(w.out, strlen(name));
+        w.out += name;
+        w.I32(4, 0); // UNCOMPRESSED
+        w.I64(5, c.values);
+        w.I64(6, c.size);
+        w.I64(7, c.size);
+        w.I64(9, c.data_offset);
+        if (dictionary) w.I64(11, c.offset);
+        w.Begin(12);
+        w.Binary(1, c.max);
+        w.Binary(2, c.min);
+        w.I64(3, 0);
+        w.Binary(5, c.max);
+        w.Binary(6, c.min);
+        w.End();
+        w.End(); // ColumnMetaData
+        w.End(); // ColumnChunk
+    }
+
+    bool Close(const std::string& created_by) {
+        ThriftWriter w;
+        w.Open(); // FileMetaData
+        w.I32(1, 1);
+        w.List(2, T_STRUCT, 5);
+        w.Open();
+        w.Binary(4, "schema");
+        w.I32(5, 4);
+        w.End();
+        w.Open();
+        w.I32(1, INT64);
+        w.I32(3, 0); // REQUIRED
+        w.Binary(4, "time");
+        w.I32(6, 9); // TIMESTAMP_MILLIS
+        w.Begin(10); // LogicalType
+        w.Begin(8);  // TimestampType
+        w.Bool(1, true);
+        w.Begin(2);
+        w.Begin(1); // MILLIS
+        w.End();
+        w.End();
+        w.End();
+        w.End();
+        w.End();
+        w.Open();
+        w.I32(1, DOUBLE);
+        w.I32(3, 0);
+        w.Binary(4, "temp");
+        w.End();
+        w.Open();
+        w.I32(1, INT64);
+        w.I32(3, 0);
+        w.Binary(4, "repeats");
+        w.End();
+        w.Open();
+        w.I32(1, INT64);
+        w.I32(3, 0);
+        w.Binary(4, "sensor");
+        w.End();
+
+        int64_t rows = 0;
+        for (size_t i = 0; i < groups.size(); i++) rows += groups[i].rows;
+        w.I64(3, rows);
+        w.List(4, T_STRUCT, groups.size());
+        for (size_t i = 0; i < groups.size(); i++) {
+            const RowGroupInfo& g = groups[i];
+            w.Open();
+            w.List(1, T_STRUCT, 4);
+            WriteColumn(w, g.time, "time", INT64);
+            WriteColumn(w, g.temp, "temp", DOUBLE);
+            WriteColumn(w, g.repeats, "repeats", INT64);
+            WriteColumn(w, g.sensor, "sensor", INT64);
+            w.I64(2, g.time.size + g.temp.size + g.repeats.size + g.sensor.size);
+            w.I64(3, g.rows);
+            w.End();
+        }
+        w.Binary(6, created_by);
+        w.End();
+
+        std::string tail = w.out;
+        uint32_t len = (uint32_t)tail.size();
+        for (int i = 0; i < 4; i++) tail.push_back((char)(len >> (8 * i)));
+        tail += "PAR1";
+        bool ok = Put(tail) && fflush(out) == 0;
+        ok = (fclose(out) == 0) && ok;
+        out = nullptr;
+        return ok;
+    }
+};
+
+// Reads back files made by Writer (and others using the same columns,
+// encodings and no codec). Files from before the repeats or sensor column
+// read as all zeros there.
+class Reader {
+public:
+    FILE* in;
+    std::vector<RowGroupInfo> groups;
+
+    Reader() : in(nullptr) {}
+    ~Reader() { if (in) fclose(in); }
+
+    bool Open(const std::string& path) {
+        in = fopen(path.c_str(), "rb");
+        if (!in || fseek(in, 0, SEEK_END) != 0) return false;
+        long size = ftell(in);
+        if (size < 12) return false;
+        std::string tail(8, '\0');
+        if (fseek(in, size - 8, SEEK_SET) != 0 || fread(&tail[0], 1, 8, in) != 8 || tail.compare(4, 4, "PAR1") != 0) {
+            return false;
+        }
+        uint32_t len = (uint8_t)tail[0] | (uint8_t)tail[1] << 8 | (uint8_t)tail[2] << 16 | (uint32_t)(uint8_t)tail[3] << 24;
+        if (len > (uint64_t)size - 12) return false;
+        std::string footer(len, '\0');
+        if (fseek(in, size - 8 - (long)len, SEEK_SET) != 0 || fread(&footer[0], 1, len, in) != len) return false;
+        return ParseFooter(footer);
+    }
+
+    bool ParseColumn(ThriftReader& r, RowGroupInfo& g) {
+        ColumnInfo c;
+        c.offset = c.data_offset = c.size = c.values = 0;
+        c.encoding = PLAIN;
+        std::string name, legacy_min, legacy_max;
+        int64_t codec = 0, dictionary = -1;
+        int type, id;
+        r.Open();
+        while (r.Next(type, id)) {
+            if (id == 3 && type == T_STRUCT) {
+                r.Open();
+                while (r.Next(type, id)) {
+                    if (id == 3 && type == T_LIST) {
+                        int elem;
+                        size_t n = r.ListHeader(elem);
+                        for (size_t i = 0; r.ok && i < n; i++) name = r.Binary();
+                    } else if (id == 4) codec = r.Zigzag();
+                    else if (id == 5) c.values = r.Zigzag();
+                    else if (id == 7) c.size = r.Zigzag();
+                    else if (id == 9) c.data_offset = r.Zigzag();
+                    else if (id == 11) dictionary = r.Zigzag();
+                    else if (id == 12 && type == T_STRUCT) {
+                        r.Open();
+                        while (r.Next(type, id)) {
+                            if (id == 1 && type == T_BINARY) legacy_max = r.Binary();
+                            else if (id == 2 && type == T_BINARY) legacy_min = r.Binary();
+                            else if (id == 5 && type == T_BINARY) c.max = r.Binary();
+                            else if (id == 6 && type == T_BINARY) c.min = r.Binary();
+                            else r.Skip(type);
+                        }
+                        r.Close();
+                    } else r.Skip(type);
+                }
+                r.Close();
+            } else {
+                r.Skip(type);
+            }
+        }
+        r.Close();
+        if (c.min.empty()) c.min = legacy_min;
+        if (c.max.empty()) c.max = legacy_max;
+        c.offset = dictionary >= 0 ? std::min(dictionary, c.data_offset) : c.data_offset;
+        if (codec != 0) return false;
+        if (name == "time") g.time = c;
+        else if (name == "temp") g.temp = c;
+        else if (name == "repeats") g.repeats = c;
+        else if (name == "sensor") g.sensor = c;
+        return true;
+    }
+
+    bool ParseFooter(const std::string& footer) {
+        ThriftReader r(footer.data(), footer.size());
+        int type, id;
+        r.Open();
+        while (r.ok && r.Next(type, id)) {
+            if (id != 4 || type != T_LIST) {
+                r.Skip(type);
+                continue;
+            }
+            int elem;
+            size_t n = r.ListHeader(elem);
+            for (size_t i = 0; r.ok && i < n; i++) {
+                RowGroupInfo g;
+                g.rows = 0;
+                g.time.size = g.temp.size = g.repeats.size = g.sensor.size = -1;
+                r.Open();
+                while (r.Next(type, id)) {
+                    if (id == 1 && type == T_LIST) {
+                        size_t columns = r.ListHeader(elem);
+                        for (size_t c = 0; r.ok && c < columns; c++) {
+                            if (!ParseColumn(r, g)) return false;
+                        }
+                    } else if (id == 3) {
+                        g.rows = r.Zigzag();
+                    } else {
+                        r.Skip(type);
+                    }
+                }
+                r.Close();
+                if (g.time.size < 0 || g.temp.size < 0) return false;
+                g.min_time = g.time.min.size() == 8 ? (int64_t)FromLittleEndian(g.time.min) : INT64_MIN;
+                g.max_time = g.time.max.size() == 8 ? (int64_t)FromLittleEndian(g.time.max) : INT64_MAX;
+                groups.push_back(g);
+            }
+        }
+        return r.ok;
+    }
+
+    // Decodes every page of a column chunk: int64 values into `ints`, or
+    // doubles into `doubles`.
+    bool ReadColumn(const ColumnInfo& c, std::vector<int64_t>* ints, std::vector<double>* doubles) {
+        std::string chunk((size_t)c.size, '\0');
+        if (c.size <= 0 || fseek(in, (long)c.offset, SEEK_SET) != 0 || fread(&chunk[0], 1, chunk.size(), in) != chunk.size()) {
+            return false;
+        }
+        std::vector<double> dictionary;
+        std::vector<uint32_t> indices;
+        size_t done = 0;
+        const uint8_t* p = (const uint8_t*)chunk.data();
+        const uint8_t* end = p + chunk.size();
+        while (done < (size_t)c.values) {
+            ThriftReader r(p, end - p);
+            int64_t page_type = -1, size = -1, values = 0, encoding = -1;
+            int type, id;
+            r.Open();
+            while (r.Next(type, id)) {
+                if (id == 1) page_type = r.Zigzag();
+                else if (id == 3) size = r.Zigzag();
+                else if ((id == 5 || id == 7) && type == T_STRUCT) {
+                    r.Open();
+                    while (r.Next(type, id)) {
+                        if (id == 1) values = r.Zigzag();
+                        else if (id == 2) encoding = r.Zigzag();
+                        else r.Skip(type);
+                    }
+                    r.Close();
+                } else r.Skip(type);
+            }
+            if (!r.ok || size < 0 || size > end - r.p) return false;
+            const uint8_t* body = r.p;
+            p = r.p + size;
+
+            if (page_type == DICTIONARY_PAGE) {
+                if (values * 8 > size) return false;
+                dictionary.resize((size_t)values);
+                for (int64_t i = 0; i < values; i++) memcpy(&dictionary[i], body + 8 * i, 8);
+                continue;
+            }
+            if (page_type != DATA_PAGE) continue;
+
+            if (encoding == DELTA_BINARY_PACKED && ints) {
+                if (!DecodeDeltas(body, p, (size_t)values, *ints)) return false;
+            } else if (encoding == PLAIN) {
+                if (values * 8 > size) return false;
+                for (int64_t i = 0; i < values; i++) {
+                    uint64_t v;
+                    memcpy(&v, body + 8 * i, 8);
+                    if (ints) ints->push_back((int64_t)v);
+                    else {
+                        double d;
+                        memcpy(&d, &v, 8);
+                        doubles->push_back(d);
+                    }
+                }
+            } else if ((encoding == RLE_DICTIONARY || encoding == PLAIN_DICTIONARY) && doubles && size > 0) {
+                indices.clear();
+                if (*body > 32 || !DecodeHybrid(body + 1, p, *body, (size_t)values, indices)) return false;
+                for (size_t i = 0; i < indices.size(); i++) {
+                    if (indices[i] >= dictionary.size()) return false;
+                    doubles->push_back(dictionary[indices[i]]);
+                }
+            } else {
+                return false;
+            }
+            done += (size_t)values;
+        }
+        return true;
+    }
+
+    // An optional INT64 column, all zeros when the file has none.
+    bool ReadInts(const ColumnInfo& c, size_t rows, std::vector<int64_t>& values) {
+        values.clear();
+        if (c.size < 0) {
+            values.assign(rows, 0);
+            return true;
+        }
+        return ReadColumn(c, &values, nullptr) && values.size() == rows;
+    }
+
+    bool ReadRowGroup(size_t i, std::vector<int64_t>& times, std::vector<double>& temps, std::vector<int64_t>& repeats,
+                      std::vector<int64_t>& sensors) {
+        times.clear();
+        temps.clear();
+        if (!ReadColumn(groups[i].time, &times, nullptr) || !ReadColumn(groups[i].temp, nullptr, &temps) ||
+            times.size() != temps.size()) {
+            return false;
+        }
+        return ReadInts(groups[i].repeats, times.size(), repeats) && ReadInts(groups[i].sensor, times.size(), sensors);
+    }
+};
+
+} // namespace parquet
+
+#endif
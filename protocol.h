@@ -0,0 +1,129 @@
+// Binary datagrams of numbered readings, shared by udp_sender.c and the
+// server. Text datagrams (one reading per line) never start with
+// PROTO_MAGIC, so both kinds can arrive on the same port.
+//
+// Header, integers little-endian:
+//   0  magic      PROTO_MAGIC
+//   1  type       PROTO_DATA (reliable, acked), PROTO_STREAM (numbered but
+//                 best-effort) or PROTO_ACK
+//   2  count      readings that follow (DATA, STREAM)
+//   4  sender     random id the sender picked at startup, or when its spool
+//                 was created
+//   8  seq        DATA, STREAM: sequence number of the first reading, the rest
+//                 follow on consecutively; ACK: every reading below it is stored
+//   16 base       DATA: oldest sequence number the sender still holds, so the
+//                 server never waits for readings that are gone
+//   24 time       DATA, STREAM: sender's wall clock (epoch microseconds)
+//                 when sent; ACK: the time of the datagram it answers, echoed
+//                 back
+//   32 rtt        DATA: the sender's recent smallest ack round trip in
+//                 microseconds, 0 while unknown; ACK: how long the server
+//                 held the datagram before acking (storing it), which the
+//                 sender takes out of the round trip
+// followed by `count` readings of PROTO_READING bytes each:
+//   0  sensor     int32, -1 when untagged
+//   4  value      IEEE float
+//   8  time       int64, sender's wall clock (epoch microseconds) when the
+//                 line came in
+//   16 repeats    uint32, further readings this one stands for: the sender's
+//                 deadband held back that many more of about the same value,
+//                 the newest of which came in at `time`
+//
+// The server corrects reading times by the sender's clock offset, estimated
+// from `time` and `rtt` (see ClockSync in server.cpp).
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROTO_MAGIC 0xA5
+#define PROTO_DATA 1
+#define PROTO_ACK 2
+#define PROTO_STREAM 3
+#define PROTO_HEADER 36
+#define PROTO_READING 20
+
+typedef struct {
+    uint8_t type;
+    uint16_t count;
+    uint32_t sender;
+    uint64_t seq;
+    uint64_t base;
+    int64_t time;
+    uint32_t rtt;
+} ProtoHeader;
+
+static inline void proto_put16(unsigned char* p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static inline void proto_put32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline void proto_put64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline uint16_t proto_get16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t proto_get32(const unsigned char* p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static inline uint64_t proto_get64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static inline void proto_write_header(unsigned char* p, const ProtoHeader* h) {
+    p[0] = PROTO_MAGIC;
+    p[1] = h->type;
+    proto_put16(p + 2, h->count);
+    proto_put32(p + 4, h->sender);
+    proto_put64(p + 8, h->seq);
+    proto_put64(p + 16, h->base);
+    proto_put64(p + 24, (uint64_t)h->time);
+    proto_put32(p + 32, h->rtt);
+}
+
+// 1 when `p` holds a well-formed datagram of `len` bytes.
+static inline int proto_read_header(const unsigned char* p, int len, ProtoHeader* h) {
+    if (len < PROTO_HEADER || p[0] != PROTO_MAGIC) return 0;
+    h->type = p[1];
+    h->count = proto_get16(p + 2);
+    h->sender = proto_get32(p + 4);
+    h->seq = proto_get64(p + 8);
+    h->base = proto_get64(p + 16);
+    h->time = (int64_t)proto_get64(p + 24);
+    h->rtt = proto_get32(p + 32);
+    return len >= PROTO_HEADER + (int)h->count * PROTO_READING;
+}
+
+static inline void proto_write_reading(unsigned char* p, int32_t sensor, float value, int64_t time,
+                                       uint32_t repeats) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    proto_put32(p, (uint32_t)sensor);
+    proto_put32(p + 4, bits);
+    proto_put64(p + 8, (uint64_t)time);
+    proto_put32(p + 16, repeats);
+}
+
+static inline void proto_read_reading(const unsigned char* p, int32_t* sensor, float* value, int64_t* time,
+                                      uint32_t* repeats) {
+    uint32_t bits = proto_get32(p + 4);
+    *sensor = (int32_t)proto_get32(p);
+    memcpy(value, &bits, sizeof(bits));
+    *time = (int64_t)proto_get64(p + 8);
+    *repeats = proto_get32(p + 16);
+}
+
+#endif
@@ -2,11 +2,18 @@
 #include <string>
 #include <sstream>
 #include <vector>
-#include <ctime>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <ctype.h>
 
-#include "sqlite3.h"
+#include "storage.h"
+#include "protocol.h"
 
 #if defined (WIN32)
     #include <winsock2.h>
@@ -29,115 +36,668 @@
     #define POLL_FUNC poll
 #endif
 
-class DB {
+Clock g_clock;
+DB g_db;
+
+// `s` as a JSON string, quotes included: sqlite error text and file names
+// given in a request may hold quotes, backslashes or control characters.
+static std::string JsonString(const std::string& s) {
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", c);
+            out += buf;
+        } else {
+            out += (char)c;
+        }
+    }
+    return out + "\"";
+}
+
+// Online copy of data.db made with the sqlite3_backup API on a thread and a
+// connection of its own. The source connection holds one read transaction
+// for the whole copy, so under WAL the copy is a consistent snapshot that is
+// never restarted by concurrent inserts, and inserts never wait for it. Pages
+// are copied a small batch at a time with a pause in between, which bounds
+// the I/O it steals from ingest and queries.
+class Backup {
 public:
-    sqlite3* db;
+    static const int PAGES_PER_STEP = 128;
+    static const int PAUSE_MS = 2;
+
+    std::mutex lock;         // guards state, file and error
+    std::string state;       // idle, running, done, failed
+    std::string file;
+    std::string error;
+    std::atomic<int64_t> pages_done, pages_total, page_size, started_ms, finished_ms;
+    std::thread worker;
 
-    DB() : db(nullptr) {}
-    ~DB() { if (db) sqlite3_close(db); }
+    Backup() : state("idle"), pages_done(0), pages_total(0), page_size(0), started_ms(0), finished_ms(0) {}
 
-    bool Open(const char* filename) {
-        if (sqlite3_open(filename, &db) != SQLITE_OK) {
-            std::cout << "DB Error: Can't open database file!" << std::endl;
+    ~Backup() { if (worker.joinable()) worker.join(); }
+
+    // Only plain file names in the working directory, never data.db itself.
+    static bool ValidName(const std::string& name, const std::string& source) {
+        if (name.empty() || name[0] == '.' || name.size() > 128) return false;
+        if (name == source || name.compare(0, source.size(), source) == 0) return false;
+        for (size_t i = 0; i < name.size(); i++) {
+            char c = name[i];
+            if (!isalnum((unsigned char)c) && c != '.' && c != '_' && c != '-') return false;
+        }
+        return true;
+    }
+
+    bool Start(const std::string& source, const std::string& target, std::string& why) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (state == "running") {
+            why = "a backup is already running";
             return false;
         }
-        const char* sql = "CREATE TABLE IF NOT EXISTS log (time INTEGER, temp REAL);";
-        char* errMsg = 0;
-        if (sqlite3_exec(db, sql, 0, 0, &errMsg) != SQLITE_OK) {
-            std::cout << "DB Init Error: " << errMsg << std::endl;
-            sqlite3_free(errMsg);
+        if (!ValidName(target, source)) {
+            why = "invalid backup file name";
             return false;
         }
+        if (worker.joinable()) worker.join();
+        state = "running";
+        file = target;
+        error.clear();
+        pages_done = pages_total = 0;
+        started_ms = NowMs();
+        finished_ms = 0;
+        worker = std::thread(&Backup::Run, this, source, target);
         return true;
     }
 
-    void Insert(float temp) {
-        char sql[256];
-        sprintf(sql, "INSERT INTO log VALUES (%ld, %.2f);", (long)time(NULL), temp);
-        char* errMsg = 0;
-        if (sqlite3_exec(db, sql, 0, 0, &errMsg) != SQLITE_OK) {
-            std::cout << "Insert Error: " << errMsg << std::endl;
-            sqlite3_free(errMsg);
-        } else {
-            std::cout << "Saved: " << temp << std::endl;
-        }
-    }
-
-    std::string GetLastRecord() {
-        sqlite3_stmt* stmt;
-        const char* sql = "SELECT time, temp FROM log ORDER BY time DESC LIMIT 1;";
-        std::string result = "No data yet";
-
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-            if (sqlite3_step(stmt) == SQLITE_ROW) {
-                time_t t = (time_t)sqlite3_column_int64(stmt, 0);
-                double temp = sqlite3_column_double(stmt, 1);
-                
-                char buf[100];
-                struct tm* tm_info = localtime(&t);
-                strftime(buf, sizeof(buf), "%H:%M:%S", tm_info);
-                
-                std::stringstream ss;
-                ss << buf << " | " << temp << " °C";
-                result = ss.str();
+    static int64_t NowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Finish(const char* result, const std::string& why) {
+        finished_ms = NowMs();
+        std::lock_guard<std::mutex> guard(lock);
+        state = result;
+        error = why;
+    }
+
+    void Run(std::string source, std::string target) {
+        sqlite3* src = nullptr;
+        sqlite3* dst = nullptr;
+        std::string why;
+        int rc = sqlite3_open_v2(source.c_str(), &src, SQLITE_OPEN_READONLY, 0);
+        if (rc == SQLITE_OK) {
+            sqlite3_busy_timeout(src, 1000);
+            rc = sqlite3_exec(src, "BEGIN; SELECT COUNT(*) FROM sqlite_master;", 0, 0, 0);
+        }
+        remove(target.c_str());
+        if (rc == SQLITE_OK) rc = sqlite3_open(target.c_str(), &dst);
+
+        sqlite3_backup* b = (rc == SQLITE_OK) ? sqlite3_backup_init(dst, "main", src, "main") : nullptr;
+        if (b) {
+            sqlite3_stmt* stmt;
+            if (sqlite3_prepare_v2(src, "PRAGMA page_size;", -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+                page_size = sqlite3_column_int64(stmt, 0);
             }
+            sqlite3_finalize(stmt);
+
+            do {
+                rc = sqlite3_backup_step(b, PAGES_PER_STEP);
+                pages_total = sqlite3_backup_pagecount(b);
+                pages_done = pages_total - sqlite3_backup_remaining(b);
+                if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds((int)PAUSE_MS));
+                }
+            } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+            sqlite3_backup_finish(b);
+            if (rc == SQLITE_DONE) rc = SQLITE_OK;
         }
-        sqlite3_finalize(stmt);
-        return result;
+        if (rc != SQLITE_OK || !b) why = sqlite3_errmsg(dst ? dst : src);
+
+        if (src) sqlite3_exec(src, "COMMIT;", 0, 0, 0);
+        sqlite3_close(src);
+        sqlite3_close(dst);
+
+        Finish(why.empty() ? "done" : "failed", why);
+        std::cout << "Backup to " << target << ": " << Status() << std::endl;
     }
 
-    std::string GetAverage(time_t seconds_back) {
-        sqlite3_stmt* stmt;
-        const char* sql = "SELECT AVG(temp) FROM log WHERE time > ?;";
-        std::string result = "--";
+    std::string Status() {
+        int64_t done = pages_done, total = pages_total, size = page_size;
+        int64_t elapsed = (finished_ms ? (int64_t)finished_ms : NowMs()) - started_ms;
+        std::lock_guard<std::mutex> guard(lock);
+        std::stringstream json;
+        json << "{\"state\":\"" << state << "\"";
+        if (state != "idle") {
+            double mb_per_sec = elapsed > 0 ? done * size / 1048576.0 / (elapsed / 1000.0) : 0;
+            char rate[32];
+            sprintf(rate, "%.1f", mb_per_sec);
+            json << ",\"file\":" << JsonString(file) << ",\"pages_done\":" << done << ",\"pages_total\":" << total
+                 << ",\"bytes_done\":" << done * size << ",\"elapsed_ms\":" << elapsed
+                 << ",\"mb_per_sec\":" << rate;
+        }
+        if (!error.empty()) json << ",\"error\":" << JsonString(error);
+        json << "}";
+        return json.str();
+    }
+};
 
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-            sqlite3_bind_int64(stmt, 1, time(NULL) - seconds_back);
-            
-            if (sqlite3_step(stmt) == SQLITE_ROW) {
-                if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
-                    double avg = sqlite3_column_double(stmt, 0);
-                    char buf[32];
-                    sprintf(buf, "%.2f", avg);
-                    result = std::string(buf);
-                }
+Backup g_backup;
+
+// Parquet export of [from, to) made on a thread with a read-only connection
+// of its own, one row group per UTC day. Each day is read inside one read
+// transaction, so sealing can't move rows between blocks and log under it.
+// The file is written under a temporary name and renamed when complete; the
+// main loop then registers it (Collect), since it owns the writing connection.
+class Exporter {
+public:
+    std::mutex lock;   // guards state, file, error, result and collected
+    std::string state; // idle, running, done, failed
+    std::string file;
+    std::string error;
+    Archive result;
+    bool collected;
+    std::atomic<int64_t> from, to, rows, row_groups, bytes, started_ms, finished_ms;
+    std::thread worker;
+
+    Exporter() : state("idle"), collected(true), from(0), to(0), rows(0), row_groups(0), bytes(0), started_ms(0), finished_ms(0) {}
+
+    ~Exporter() { if (worker.joinable()) worker.join(); }
+
+    bool Start(const std::string& source, const std::string& target, int64_t begin, int64_t end, std::string& why) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (state == "running") {
+            why = "an export is already running";
+            return false;
+        }
+        if (!Backup::ValidName(target, source)) {
+            why = "invalid archive file name";
+            return false;
+        }
+        if (begin >= end) {
+            why = "need from < to";
+            return false;
+        }
+        if (worker.joinable()) worker.join();
+        state = "running";
+        file = target;
+        error.clear();
+        collected = true;
+        from = begin;
+        to = end;
+        rows = row_groups = bytes = 0;
+        started_ms = Backup::NowMs();
+        finished_ms = 0;
+        worker = std::thread(&Exporter::Run, this, source, target);
+        return true;
+    }
+
+    void Finish(const char* outcome, const std::string& why) {
+        finished_ms = Backup::NowMs();
+        std::lock_guard<std::mutex> guard(lock);
+        state = outcome;
+        error = why;
+        collected = (strcmp(outcome, "done") != 0);
+    }
+
+    void Run(std::string source, std::string target) {
+        DB reader;
+        if (!reader.OpenReadOnly(source.c_str()) || reader.partitions.empty()) {
+            Finish("failed", "no raw data to export");
+            return;
+        }
+        // Days retention already dropped can't be exported.
+        int64_t begin = std::max<int64_t>(from, reader.partitions[0] * MS_PER_DAY), end = to;
+        from = begin;
+
+        std::string tmp = target + ".tmp";
+        parquet::Writer writer;
+        bool ok = writer.Open(tmp);
+        std::vector<Sample> samples;
+        std::vector<int64_t> times;
+        std::vector<double> temps;
+        std::vector<int64_t> repeats;
+        std::vector<int64_t> sensors;
+        for (int64_t day = begin / MS_PER_DAY; ok && begin < end && day <= (end - 1) / MS_PER_DAY; day++) {
+            int64_t a = std::max(begin, day * MS_PER_DAY), b = std::min(end, (day + 1) * MS_PER_DAY);
+            samples.clear();
+            std::function<void(const Sample&)> add = [&](const Sample& x) { samples.push_back(x); };
+            reader.Exec("BEGIN;");
+            reader.ScanBlocks(ALL_SENSORS, a, b, add);
+            reader.ScanLog(ALL_SENSORS, a, b, add);
+            reader.Exec("COMMIT;");
+            if (samples.empty()) continue;
+
+            std::stable_sort(samples.begin(), samples.end(), [](const Sample& x, const Sample& y) { return x.time < y.time; });
+            times.resize(samples.size());
+            temps.resize(samples.size());
+            repeats.resize(samples.size());
+            sensors.resize(samples.size());
+            for (size_t i = 0; i < samples.size(); i++) {
+                times[i] = samples[i].time;
+                temps[i] = FromFixed(samples[i].value);
+                repeats[i] = samples[i].repeats;
+                sensors[i] = samples[i].sensor;
             }
+            ok = writer.WriteRowGroup(times, temps, repeats, sensors);
+            rows += samples.size();
+            row_groups++;
+            bytes = writer.offset;
         }
-        sqlite3_finalize(stmt);
-        return result;
+        ok = ok && writer.Close("thermometer server");
+        bytes = writer.offset;
+        remove(target.c_str());
+        if (ok) ok = (rename(tmp.c_str(), target.c_str()) == 0);
+        if (!ok) {
+            remove(tmp.c_str());
+            Finish("failed", "can't write " + target);
+        } else {
+            Archive a = { target, begin, end, rows };
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                result = a;
+            }
+            Finish("done", "");
+        }
+        std::cout << "Export to " << target << ": " << Status() << std::endl;
     }
-    
-    std::string GetHistoryHTML() {
-        sqlite3_stmt* stmt;
-        const char* sql = "SELECT time, temp FROM log ORDER BY time DESC LIMIT 10;";
-        std::stringstream html;
-        
-        html << "<table><tr><th>Time</th><th>Temp</th></tr>";
-
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-            while (sqlite3_step(stmt) == SQLITE_ROW) {
-                time_t t = (time_t)sqlite3_column_int64(stmt, 0);
-                double temp = sqlite3_column_double(stmt, 1);
-                
-                char buf[100];
-                struct tm* tm_info = localtime(&t);
-                strftime(buf, sizeof(buf), "%H:%M:%S", tm_info);
-
-                html << "<tr><td>" << buf << "</td><td>" << temp << "</td></tr>";
+
+    // The archive of a finished export, handed over once.
+    bool Collect(Archive& a) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (state != "done" || collected) return false;
+        collected = true;
+        a = result;
+        return true;
+    }
+
+    std::string Status() {
+        int64_t elapsed = (finished_ms ? (int64_t)finished_ms : Backup::NowMs()) - started_ms;
+        std::lock_guard<std::mutex> guard(lock);
+        std::stringstream json;
+        json << "{\"state\":\"" << state << "\"";
+        if (state != "idle") {
+            json << ",\"file\":" << JsonString(file) << ",\"from\":" << from << ",\"to\":" << to
+                 << ",\"rows\":" << rows << ",\"row_groups\":" << row_groups << ",\"bytes\":" << bytes
+                 << ",\"elapsed_ms\":" << elapsed;
+        }
+        if (!error.empty()) json << ",\"error\":" << JsonString(error);
+        json << "}";
+        return json.str();
+    }
+};
+
+Exporter g_exporter;
+
+// Latest reading from each tagged sensor ("ID:value" lines, as sent by a
+// udp_sender serving several devices). Each sensor's readings are stored
+// as a series of their own (see Sample::sensor); this says which probes
+// have reported since startup and what they last sent.
+class Sensors {
+public:
+    struct State {
+        int64_t time;
+        float value;
+        uint64_t count;
+    };
+    std::map<int, State> states;
+
+    void Note(int id, int64_t time, float value, uint64_t count) {
+        State& s = states[id];
+        s.time = time;
+        s.value = value;
+        s.count += count;
+    }
+
+    std::string JSON() {
+        std::stringstream json;
+        json << "[";
+        for (std::map<int, State>::iterator it = states.begin(); it != states.end(); ++it) {
+            if (it != states.begin()) json << ",";
+            json << "{\"id\":" << it->first << ",\"time\":" << it->second.time
+                 << ",\"value\":" << it->second.value << ",\"count\":" << it->second.count << "}";
+        }
+        json << "]";
+        return json.str();
+    }
+};
+
+Sensors g_sensors;
+
+// What UDP drops, duplicates and reorders between numbered senders and us,
+// seen from the sequence numbers of their datagrams (protocol.h). Each sender
+// gets a ring of WINDOW bits over the newest sequence numbers, so a datagram
+// costs a few word operations whatever its size or lateness. A skipped range
+// counts as lost until it turns up late (reordered); a range whose bits are
+// already set is a duplicate; one from before the window is too late to
+// tell. Replays of reliable senders show up as late or duplicate readings.
+class LossMeter {
+public:
+    static const uint64_t WINDOW = 1024;
+    static const size_t MAX_SENDERS = 16384;
+
+    struct Counts {
+        uint64_t received, lost, duplicates, reordered, too_late;
+    };
+
+    struct Tracker {
+        uint64_t top; // one past the newest sequence number seen
+        uint64_t bits[WINDOW / 64];
+        time_t last_seen;
+        Counts counts;
+    };
+
+    std::unordered_map<uint32_t, Tracker> trackers;
+    Counts retired;  // of trackers evicted to stay under MAX_SENDERS
+    uint64_t datagrams, unnumbered;
+
+    LossMeter() : datagrams(0), unnumbered(0) { memset(&retired, 0, sizeof(retired)); }
+
+    // Readings [seq, seq + count) from `sender`; returns how many of them
+    // are duplicates, and marks which in `duplicates` (count entries) when
+    // given. Readings from before the window can't be told apart from new
+    // ones, so they are never marked.
+    uint64_t Observe(uint32_t sender, uint64_t seq, uint64_t count, std::vector<bool>* duplicates = nullptr) {
+        datagrams++;
+        std::unordered_map<uint32_t, Tracker>::iterator it = trackers.find(sender);
+        if (it == trackers.end()) {
+            if (trackers.size() >= MAX_SENDERS) Evict();
+            Tracker fresh;
+            memset(&fresh, 0, sizeof(fresh));
+            fresh.top = seq; // whatever came before us isn't ours to count
+            it = trackers.insert(std::make_pair(sender, fresh)).first;
+        }
+        Tracker& t = it->second;
+        Counts& c = t.counts;
+        t.last_seen = time(NULL);
+
+        uint64_t end = seq + count, old_top = t.top;
+        if (end > t.top) {
+            if (seq > t.top) c.lost += seq - t.top;
+            if (end - t.top >= WINDOW) memset(t.bits, 0, sizeof(t.bits));
+            else Apply(t, t.top, end, false);
+            t.top = end;
+        }
+        uint64_t floor = t.top < WINDOW ? 0 : t.top - WINDOW;
+        uint64_t from = std::min(std::max(seq, floor), end);
+        c.too_late += from - seq;
+
+        // Within the part that was already inside the window, set bits are
+        // duplicates and clear ones fill an earlier gap.
+        uint64_t dup = 0;
+        if (from < old_top) {
+            uint64_t to = std::min(end, old_top);
+            dup = Apply(t, from, to, true, duplicates, seq);
+            uint64_t filled = (to - from) - dup;
+            c.reordered += filled;
+            c.lost -= std::min(c.lost, filled);
+        }
+        if (from < end) Apply(t, std::max(from, old_top), end, true);
+        c.duplicates += dup;
+        c.received += count - dup - (from - seq);
+        return dup;
+    }
+
+    void ObserveUnnumbered(uint64_t readings) {
+        datagrams++;
+        unnumbered += readings;
+    }
+
+    std::string JSON() {
+        Counts total = retired;
+        std::stringstream senders;
+        for (std::unordered_map<uint32_t, Tracker>::iterator it = trackers.begin(); it != trackers.end(); ++it) {
+            Add(total, it->second.counts);
+            if (it != trackers.begin()) senders << ",";
+            senders << "{\"sender\":" << it->first << "," << CountsJSON(it->second.counts) << "}";
+        }
+        std::stringstream json;
+        json << "{\"datagrams\":" << datagrams << ",\"unnumbered\":" << unnumbered << ","
+             << CountsJSON(total) << ",\"senders\":[" << senders.str() << "]}";
+        return json.str();
+    }
+
+private:
+    // Sets (or clears) the bits of [from, to) one word at a time; returns
+    // how many of them were set before, marking those in `seen` (indexed
+    // from `base`) when given.
+    static uint64_t Apply(Tracker& t, uint64_t from, uint64_t to, bool set, std::vector<bool>* seen = nullptr,
+                          uint64_t base = 0) {
+        uint64_t was = 0;
+        while (from < to) {
+            uint64_t offset = from % 64, len = std::min<uint64_t>(64 - offset, to - from);
+            uint64_t mask = (len == 64 ? ~(uint64_t)0 : (((uint64_t)1 << len) - 1)) << offset;
+            uint64_t& word = t.bits[from / 64 % (WINDOW / 64)];
+            uint64_t hit = word & mask;
+            was += PopCount(hit);
+            for (uint64_t b = offset; seen && b < 64 && hit >> b; b++) {
+                if (hit >> b & 1) (*seen)[from + (b - offset) - base] = true;
             }
+            if (set) word |= mask;
+            else word &= ~mask;
+            from += len;
         }
-        sqlite3_finalize(stmt);
-        html << "</table>";
-        return html.str();
+        return was;
+    }
+
+    static uint64_t PopCount(uint64_t v) {
+        v = v - ((v >> 1) & 0x5555555555555555ULL);
+        v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+        v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        return (v * 0x0101010101010101ULL) >> 56;
+    }
+
+    static void Add(Counts& a, const Counts& b) {
+        a.received += b.received;
+        a.lost += b.lost;
+        a.duplicates += b.duplicates;
+        a.reordered += b.reordered;
+        a.too_late += b.too_late;
+    }
+
+    static std::string CountsJSON(const Counts& c) {
+        std::stringstream json;
+        json.precision(6);
+        json << "\"received\":" << c.received << ",\"lost\":" << c.lost << ",\"duplicates\":" << c.duplicates
+             << ",\"reordered\":" << c.reordered << ",\"too_late\":" << c.too_late << ",\"loss_rate\":"
+             << (c.received + c.lost ? (double)c.lost / (c.received + c.lost) : 0.0);
+        return json.str();
+    }
+
+    // Drops the sender heard from least recently, keeping its counts in the
+    // totals. Only a new sender arriving at a full table pays for the scan.
+    void Evict() {
+        std::unordered_map<uint32_t, Tracker>::iterator oldest = trackers.begin();
+        for (std::unordered_map<uint32_t, Tracker>::iterator it = trackers.begin(); it != trackers.end(); ++it) {
+            if (it->second.last_seen < oldest->second.last_seen) oldest = it;
+        }
+        Add(retired, oldest->second.counts);
+        trackers.erase(oldest);
     }
 };
 
-DB g_db;
+LossMeter g_loss;
+
+// Per-sender clock offsets, so readings are stored at the time they were
+// captured (protocol.h) as our clock tells it. Our receive time minus a
+// datagram's send time is the offset plus that datagram's one-way delay, so
+// the smallest such bound is the best one; half the round trip the sender
+// measured from acks takes out the rest. Bounds are kept per WINDOW_US and
+// the estimate uses the last two windows, so a drifting or reset sender
+// clock is followed within minutes. All times are epoch microseconds, with
+// ours taken when the kernel received the datagram, so the offset is good
+// enough to split latencies well below a millisecond.
+class ClockSync {
+public:
+    static const int64_t WINDOW_US = 60 * 1000 * 1000;
+    static const size_t MAX_SENDERS = 16384;
+
+    struct Estimate {
+        int64_t window_start;
+        int64_t best, previous; // smallest bound in this window and the last
+        int64_t rtt;
+    };
+
+    std::unordered_map<uint32_t, Estimate> senders;
+
+    // Offset to add to `sender`'s clock, after a datagram it sent at `sent`
+    // (its clock) arrived at `received` (ours).
+    int64_t Update(uint32_t sender, int64_t sent, int64_t received, int64_t rtt) {
+        int64_t bound = received - sent;
+        std::unordered_map<uint32_t, Estimate>::iterator it = senders.find(sender);
+        if (it == senders.end()) {
+            if (senders.size() >= MAX_SENDERS) Evict();
+            Estimate fresh = { received, bound, INT64_MAX, rtt };
+            it = senders.insert(std::make_pair(sender, fresh)).first;
+        }
+        Estimate& e = it->second;
+        if (received - e.window_start >= WINDOW_US) {
+            e.previous = e.best;
+            e.best = bound;
+            e.window_start = received;
+        } else {
+            e.best = std::min(e.best, bound);
+        }
+        e.rtt = rtt;
+        return Offset(e);
+    }
+
+    static int64_t Offset(const Estimate& e) { return std::min(e.best, e.previous) - e.rtt / 2; }
+
+    std::string JSON() {
+        std::stringstream json;
+        json << "[";
+        for (std::unordered_map<uint32_t, Estimate>::iterator it = senders.begin(); it != senders.end(); ++it) {
+            if (it != senders.begin()) json << ",";
+            json << "{\"sender\":" << it->first << ",\"offset_ms\":" << Offset(it->second) / 1000.0
+                 << ",\"rtt_ms\":" << it->second.rtt / 1000.0 << "}";
+        }
+        json << "]";
+        return json.str();
+    }
+
+private:
+    // Drops the sender whose window started longest ago.
+    void Evict() {
+        std::unordered_map<uint32_t, Estimate>::iterator oldest = senders.begin();
+        for (std::unordered_map<uint32_t, Estimate>::iterator it = senders.begin(); it != senders.end(); ++it) {
+            if (it->second.window_start < oldest->second.window_start) oldest = it;
+        }
+        senders.erase(oldest);
+    }
+};
+
+ClockSync g_clocks;
+
+// Latencies in microseconds, in buckets of an eighth of a power of two, so
+// percentiles are within 12.5% from a microsecond to days and adding one is
+// a few instructions.
+class LatencyHistogram {
+public:
+    static const int SUB = 8;
+    static const int BUCKETS = 40 * SUB;
+
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    int64_t max;
+    double sum;
+
+    LatencyHistogram() : total(0), max(0), sum(0) { memset(counts, 0, sizeof(counts)); }
+
+    void Add(int64_t us, uint64_t n = 1) {
+        if (n == 0) return;
+        us = std::max<int64_t>(0, us);
+        counts[Bucket(us)] += n;
+        total += n;
+        max = std::max(max, us);
+        sum += (double)us * n;
+    }
+
+    // Upper edge of the bucket holding quantile q (0..1), or the largest
+    // value seen when that is smaller.
+    int64_t Percentile(double q) const {
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)ceil(q * total));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(max, Lower(i + 1) - 1);
+        }
+        return max;
+    }
+
+    std::string JSON() const {
+        std::stringstream json;
+        json << std::fixed;
+        json.precision(3);
+        json << "{\"count\":" << total << ",\"mean\":" << (total ? sum / total / 1000 : 0.0)
+             << ",\"p50\":" << Percentile(0.5) / 1000.0 << ",\"p90\":" << Percentile(0.9) / 1000.0
+             << ",\"p99\":" << Percentile(0.99) / 1000.0 << ",\"p999\":" << Percentile(0.999) / 1000.0
+             << ",\"max\":" << max / 1000.0 << "}";
+        return json.str();
+    }
+
+private:
+    // Values below SUB get a bucket each; above, the top four bits pick one.
+    static int Bucket(int64_t us) {
+        if (us < SUB) return (int)us;
+        int e = 63 - CountLeadingZeros((uint64_t)us);
+        int i = (e - 2) * SUB + (int)((us >> (e - 3)) & (SUB - 1));
+        return std::min(i, BUCKETS - 1);
+    }
+
+    static int64_t Lower(int i) {
+        if (i < SUB) return i;
+        int e = i / SUB + 2;
+        return (int64_t)(SUB + i % SUB) << (e - 3);
+    }
+
+    static int CountLeadingZeros(uint64_t v) {
+        int n = 0;
+        for (uint64_t bit = (uint64_t)1 << 63; !(v & bit); bit >>= 1) n++;
+        return n;
+    }
+};
+
+// Where the time goes between a reading coming in on a serial line and
+// GetLastRecord showing it, stage by stage, per reading:
+//   sender   line in to datagram sent: the sender's batching and deadband
+//   network  datagram sent to the kernel taking it in (clock-corrected)
+//   queue    waiting in the socket's receive buffer until Read
+//   commit   Read to the insert committed
+//   publish  commit to the reading visible in the ring of latest ones
+//   total    line in to visible
+// Only numbered readings carry the time they came in, so text readings have
+// no sender or network stage, and their total starts at the kernel. The
+// kernel's receive time is only known where SO_TIMESTAMPNS is (Linux);
+// elsewhere queue reads zero and network runs to Read. Senders without acks
+// report no round trip, so their clock offset takes in the smallest one-way
+// delay, and network shows only the delay beyond it.
+class Latency {
+public:
+    LatencyHistogram sender, network, queue, commit, publish, total;
+
+    std::string JSON() const {
+        return "{\"sender\":" + sender.JSON() + ",\"network\":" + network.JSON() + ",\"queue\":" + queue.JSON() +
+               ",\"commit\":" + commit.JSON() + ",\"publish\":" + publish.JSON() + ",\"total\":" + total.JSON() +
+               "}";
+    }
+};
+
+Latency g_latency;
 
 class UdpListener {
 public:
     MySocket sock;
-    UdpListener() : sock(BAD_SOCKET) {}
+    std::map<uint32_t, Delivery> deliveries; // reliable senders, by id
+    // The datagram being handled: when Read got it, and when it arrived
+    // (epoch microseconds; the same as read_us where the kernel won't say).
+    std::chrono::steady_clock::time_point read_at;
+    int64_t read_us, arrived_us;
+    UdpListener() : sock(BAD_SOCKET), read_us(0), arrived_us(0) {}
     ~UdpListener() { if(sock != BAD_SOCKET) CLOSE_SOCK(sock); }
 
     bool Start(int port) {
@@ -150,17 +710,202 @@ public:
         addr.sin_addr.s_addr = htonl(INADDR_ANY);
         addr.sin_port = htons(port);
 
+#ifdef SO_TIMESTAMPNS
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#endif
         return (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
     }
 
+    // recvfrom, also noting when the datagram was read and, where the kernel
+    // tells (SO_TIMESTAMPNS), when it arrived.
+    int Receive(char* buf, int size, sockaddr_in& from) {
+        int len;
+#ifdef SO_TIMESTAMPNS
+        iovec iov = { buf, (size_t)size };
+        char control[CMSG_SPACE(sizeof(timespec))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        len = recvmsg(sock, &msg, 0);
+        arrived_us = 0;
+        for (cmsghdr* c = len > 0 ? CMSG_FIRSTHDR(&msg) : nullptr; c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                arrived_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            }
+        }
+#else
+        socklen_t from_len = sizeof(from);
+        len = recvfrom(sock, buf, size, 0, (struct sockaddr*)&from, &from_len);
+        arrived_us = 0;
+#endif
+        read_at = std::chrono::steady_clock::now();
+        read_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (!arrived_us) arrived_us = read_us;
+        return len;
+    }
+
+    // Server-side stages of the `readings` of the datagram just stored (see
+    // Latency). Text readings carry no origin, so their total starts at the
+    // kernel.
+    void MeasureStored(uint64_t readings, bool numbered) {
+        int64_t committed = Micros(g_db.committed - read_at), published = Micros(g_db.published - read_at);
+        g_latency.queue.Add(read_us - arrived_us, readings);
+        g_latency.commit.Add(committed, readings);
+        g_latency.publish.Add(published - committed, readings);
+        if (!numbered) g_latency.total.Add(read_us + published - arrived_us, readings);
+    }
+
+    // The stages before it for numbered readings, from `origins`: when each
+    // came in to the sender, in microseconds on our clock (see Unpack).
+    void MeasureOrigins(const std::vector<int64_t>& origins, const ProtoHeader& h, int64_t offset) {
+        int64_t sent = h.time + offset;
+        int64_t visible = read_us + Micros(g_db.published - read_at);
+        g_latency.network.Add(arrived_us - sent, origins.size());
+        for (size_t i = 0; i < origins.size(); i++) {
+            g_latency.sender.Add(sent - origins[i]);
+            g_latency.total.Add(visible - origins[i]);
+        }
+    }
+
+    static int64_t Micros(std::chrono::steady_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    }
+
+    // A datagram holds one reading, or several one per line when the
+    // sender batches them. A reading may carry a sensor id ("ID:value") and
+    // a count of further readings it stands for ("value*REPEATS").
     void Read() {
-        char buf[256];
-        int len = recv(sock, buf, sizeof(buf) - 1, 0);
-        if (len > 0) {
-            buf[len] = '\0';
-            float temp = (float)atof(buf);
-            g_db.Insert(temp);
+        static char buf[65536];
+        sockaddr_in from;
+        int len = Receive(buf, sizeof(buf) - 1, from);
+        if (len <= 0) return;
+        if ((unsigned char)buf[0] == PROTO_MAGIC) {
+            ReadNumbered((const unsigned char*)buf, len, from);
+            return;
+        }
+        buf[len] = '\0';
+
+        std::vector<float> temps;
+        std::vector<int64_t> repeats;
+        std::vector<int> sensors;
+        int64_t now = g_clock.Now();
+        char* line = buf;
+        while (*line) {
+            char* end = strchr(line, '\n');
+            if (end) *end = '\0';
+            if (*line && *line != '\r') {
+                char* colon = strchr(line, ':');
+                char* star = strchr(line, '*');
+                float temp = (float)atof(colon ? colon + 1 : line);
+                int64_t more = star ? std::max<int64_t>(0, atoll(star + 1)) : 0;
+                int sensor = colon ? std::max(0, atoi(line)) : 0;
+                if (colon) g_sensors.Note(sensor, now, temp, 1 + more);
+                temps.push_back(temp);
+                repeats.push_back(more);
+                sensors.push_back(sensor);
+            }
+            if (!end) break;
+            line = end + 1;
+        }
+        g_loss.ObserveUnnumbered(temps.size());
+        if (temps.size() == 1) {
+            if (g_db.Insert(temps[0], repeats[0], sensors[0])) MeasureStored(1, false);
+        } else if (temps.size() > 1) {
+            std::vector<Sample> samples;
+            for (size_t i = 0; i < temps.size(); i++) samples.push_back(Sample{ now, ToFixed(temps[i]), repeats[i], sensors[i] });
+            if (g_db.InsertBatch(samples)) MeasureStored(samples.size(), false);
+        }
+    }
+
+    // A numbered datagram. Best-effort ones (PROTO_STREAM) have their
+    // duplicate readings dropped and the rest stored, including any too late
+    // to check; reliable ones go through ReadReliable.
+    void ReadNumbered(const unsigned char* buf, int len, const sockaddr_in& from) {
+        ProtoHeader h;
+        if (!proto_read_header(buf, len, &h) || (h.type != PROTO_DATA && h.type != PROTO_STREAM)) return;
+        std::vector<bool> duplicate(h.count, false);
+        uint64_t duplicates = g_loss.Observe(h.sender, h.seq, h.count, &duplicate);
+        if (h.type == PROTO_DATA) {
+            ReadReliable(buf, h, from);
+            return;
+        }
+        if (duplicates == h.count) return;
+
+        int64_t offset = SyncClock(h);
+        std::vector<Sample> samples;
+        std::vector<int64_t> origins;
+        for (int i = 0; i < h.count; i++) {
+            if (!duplicate[i]) samples.push_back(Unpack(buf, h, i, offset, origins));
         }
+        if (samples.empty() || !g_db.InsertBatch(samples)) return;
+        MeasureStored(samples.size(), true);
+        MeasureOrigins(origins, h, offset);
+    }
+
+    // The sender's clock offset in microseconds, from a numbered datagram
+    // that just arrived.
+    int64_t SyncClock(const ProtoHeader& h) {
+        return g_clocks.Update(h.sender, h.time, arrived_us, h.rtt);
+    }
+
+    // Reading `i` of a numbered datagram, at its capture time on our clock
+    // (never later than now). That time in microseconds goes on `origins`.
+    Sample Unpack(const unsigned char* buf, const ProtoHeader& h, int i, int64_t offset, std::vector<int64_t>& origins) {
+        int32_t sensor;
+        float temp;
+        int64_t time;
+        uint32_t repeats;
+        proto_read_reading(buf + PROTO_HEADER + i * PROTO_READING, &sensor, &temp, &time, &repeats);
+        int64_t origin = time + offset;
+        origins.push_back(origin);
+        Sample s = { std::min(origin / 1000, g_clock.Now()), ToFixed(temp), repeats, std::max(sensor, 0) };
+        if (sensor >= 0) g_sensors.Note(sensor, s.time, temp, s.Count());
+        return s;
+    }
+
+    // Stores the readings of a reliable datagram that aren't stored yet and
+    // acks everything stored so far. Nothing is acked unless committed, so a
+    // failed insert or a server restart just means the sender replays.
+    void ReadReliable(const unsigned char* buf, const ProtoHeader& h, const sockaddr_in& from) {
+        std::map<uint32_t, Delivery>::iterator it = deliveries.find(h.sender);
+        if (it == deliveries.end()) it = deliveries.insert(std::make_pair(h.sender, g_db.LoadDelivery(h.sender))).first;
+        Delivery next = it->second;
+        next.Advance(h.base);
+
+        int64_t offset = SyncClock(h);
+        std::vector<Sample> samples;
+        std::vector<int64_t> origins;
+        for (int i = 0; i < h.count; i++) {
+            uint64_t seq = h.seq + i;
+            if (next.Seen(seq) || !next.Fits(seq)) continue; // stored, or too far ahead and replayed later
+            samples.push_back(Unpack(buf, h, i, offset, origins));
+            next.Mark(seq);
+        }
+        next.Advance(0);
+
+        if (next.acked != it->second.acked || !samples.empty()) {
+            if (!g_db.InsertBatch(samples, h.sender, &next)) return;
+            it->second = next;
+            MeasureStored(samples.size(), true);
+            MeasureOrigins(origins, h, offset);
+        }
+
+        // Echoes the send time so the sender can measure the round trip, and
+        // says how much of it was spent here.
+        unsigned char ack[PROTO_HEADER];
+        int64_t held = read_us + Micros(std::chrono::steady_clock::now() - read_at) - arrived_us;
+        ProtoHeader a = { PROTO_ACK, 0, h.sender, it->second.acked, 0, h.time, (uint32_t)held };
+        proto_write_header(ack, &a);
+        sendto(sock, (const char*)ack, sizeof(ack), 0, (const struct sockaddr*)&from, sizeof(from));
     }
 };
 
@@ -185,13 +930,147 @@ public:
         return true;
     }
 
+    // "/api/x?a=1" from "GET /api/x?a=1 HTTP/1.1"; "/" when unparsable.
+    static std::string RequestPath(const char* request) {
+        const char* start = strchr(request, ' ');
+        if (!start) return "/";
+        start++;
+        const char* end = strchr(start, ' ');
+        if (!end) return "/";
+        return std::string(start, end);
+    }
+
+    static std::string QueryParam(const std::string& path, const char* name) {
+        size_t q = path.find('?');
+        std::string key = std::string(name) + "=";
+        while (q != std::string::npos) {
+            size_t begin = q + 1;
+            size_t end = path.find('&', begin);
+            if (path.compare(begin, key.size(), key) == 0) {
+                return path.substr(begin + key.size(), end == std::string::npos ? std::string::npos : end - begin - key.size());
+            }
+            q = end;
+        }
+        return "";
+    }
+
+    static bool IsRoute(const std::string& path, const char* route) {
+        size_t len = strlen(route);
+        return path.compare(0, len, route) == 0 && (path.size() == len || path[len] == '?');
+    }
+
     void ProcessClient() {
         MySocket client = accept(sock, NULL, NULL);
         if (client == BAD_SOCKET) return;
 
         char buf[1024];
-        recv(client, buf, sizeof(buf), 0);
+        int len = recv(client, buf, sizeof(buf) - 1, 0);
+        buf[len > 0 ? len : 0] = '\0';
+        std::string path = RequestPath(buf);
 
+        std::string status = "200 OK";
+        std::string type = "text/html; charset=utf-8";
+        std::string content;
+        std::string headers;
+        // Dashboard and aggregates are of one sensor's series, 0 by default.
+        int sensor = std::max(0, atoi(QueryParam(path, "sensor").c_str()));
+        if (IsRoute(path, "/")) {
+            content = Dashboard(sensor);
+        } else if (IsRoute(path, "/api/percentiles")) {
+            std::string seconds = QueryParam(path, "seconds");
+            type = "application/json";
+            content = g_db.GetPercentilesJSON(sensor, seconds.empty() ? 86400 : atol(seconds.c_str()));
+        } else if (IsRoute(path, "/api/aggregate")) {
+            // from/to in epoch ms (default: the last hour), fn as DB::Aggregate takes it.
+            std::string from = QueryParam(path, "from"), to = QueryParam(path, "to"), fn = QueryParam(path, "fn");
+            int64_t end = to.empty() ? g_clock.Now() + 1 : atoll(to.c_str());
+            int64_t begin = from.empty() ? end - MS_PER_HOUR : atoll(from.c_str());
+            if (fn.empty()) fn = "avg";
+            double value;
+            std::string plan;
+            type = "application/json";
+            if (begin >= end || fn.find('"') != std::string::npos || !g_db.Aggregate(sensor, begin, end, fn, value, &plan)) {
+                status = "400 Bad Request";
+                content = "{\"error\":\"need from < to and fn count, sum, avg, min, max or pNN\"}";
+            } else {
+                std::stringstream json;
+                json.precision(12);
+                json << "{\"sensor\":" << sensor << ",\"from\":" << begin << ",\"to\":" << end << ",\"fn\":\"" << fn << "\",\"value\":";
+                if (std::isnan(value)) json << "null";
+                else json << value;
+                json << "}";
+                content = json.str();
+                headers = "X-Plan: " + plan + "\r\n";
+            }
+        } else if (IsRoute(path, "/api/archive")) {
+            // /api/archive?from=MS&to=MS&file=NAME starts a Parquet export
+            // (to defaults to now), /api/archive reports on it.
+            std::string target = QueryParam(path, "file"), why;
+            type = "application/json";
+            if (!target.empty()) {
+                int64_t now = g_clock.Now();
+                std::string to = QueryParam(path, "to");
+                int64_t end = to.empty() ? now : std::min<int64_t>(now, atoll(to.c_str()));
+                if (!g_exporter.Start(g_db.path, target, atoll(QueryParam(path, "from").c_str()), end, why)) {
+                    status = "409 Conflict";
+                    content = "{\"error\":" + JsonString(why) + "}";
+                }
+            }
+            if (content.empty()) content = g_exporter.Status();
+        } else if (IsRoute(path, "/api/stats")) {
+            type = "application/json";
+            content = "{\"udp\":" + g_loss.JSON() + ",\"clocks\":" + g_clocks.JSON() + ",\"latency_ms\":" +
+                      g_latency.JSON() + "}";
+        } else if (IsRoute(path, "/api/sensors")) {
+            type = "application/json";
+            content = g_sensors.JSON();
+        } else if (IsRoute(path, "/api/backup")) {
+            // /api/backup?to=FILE starts a backup, /api/backup reports on it.
+            std::string target = QueryParam(path, "to"), why;
+            type = "application/json";
+            if (!target.empty() && !g_backup.Start(g_db.path, target, why)) {
+                status = "409 Conflict";
+                content = "{\"error\":" + JsonString(why) + "}";
+            } else {
+                content = g_backup.Status();
+            }
+        } else {
+            status = "404 Not Found";
+            type = "text/plain";
+            content = "Not found";
+        }
+
+        std::stringstream response;
+        response << "HTTP/1.1 " << status << "\r\n"
+                 << "Content-Type: " << type << "\r\n"
+                 << "Content-Length: " << content.length() << "\r\n"
+                 << headers << "\r\n"
+                 << content;
+
+        send(client, response.str().c_str(), response.str().length(), 0);
+        CLOSE_SOCK(client);
+    }
+
+    // Links to the dashboard of sensor 0 (untagged readings) and of each
+    // sensor heard from, the shown one in bold; nothing when no reading was
+    // tagged.
+    static std::string SensorLinks(int current) {
+        if (g_sensors.states.empty()) return "";
+        std::vector<int> ids(1, 0);
+        for (std::map<int, Sensors::State>::iterator it = g_sensors.states.begin(); it != g_sensors.states.end(); ++it) {
+            if (it->first != 0) ids.push_back(it->first);
+        }
+        std::stringstream html;
+        html << "<p>Sensor:";
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (ids[i] == current) html << " <b>" << ids[i] << "</b>";
+            else html << " <a href='/?sensor=" << ids[i] << "'>" << ids[i] << "</a>";
+        }
+        html << "</p>";
+        return html.str();
+    }
+
+    std::string Dashboard(int sensor) {
         std::stringstream body;
         body << "<html><head>"
              << "<meta http-equiv='refresh' content='2'>"
@@ -212,37 +1091,42 @@ public:
              << "<body>"
              
              << "<h1>Thermometer</h1>"
+             << SensorLinks(sensor)
              
-             << "<div class='main-temp'>" << g_db.GetLastRecord() << "</div>"
+             << "<div class='main-temp'>" << g_db.GetLastRecord(sensor) << "</div>"
 
              << "<div class='stats-container'>"
-             << "  <div class='card'><h3>Avg (Hour)</h3><p>" << g_db.GetAverage(3600) << " °C</p></div>"
-             << "  <div class='card'><h3>Avg (24 Hours)</h3><p>" << g_db.GetAverage(86400) << " °C</p></div>"
-             << "  <div class='card'><h3>Avg (Month)</h3><p>" << g_db.GetAverage(2592000) << " °C</p></div>"
+             << "  <div class='card'><h3>Avg (Hour)</h3><p>" << g_db.GetAverage(sensor, 3600) << " °C</p></div>"
+             << "  <div class='card'><h3>Avg (24 Hours)</h3><p>" << g_db.GetAverage(sensor, 86400) << " °C</p></div>"
+             << "  <div class='card'><h3>Avg (Month)</h3><p>" << g_db.GetAverage(sensor, 2592000) << " °C</p></div>"
+             << "  <div class='card'><h3>p50 / p95 / p99 (24 Hours)</h3><p>" << g_db.GetPercentiles(sensor, 86400) << " °C</p></div>"
              << "</div>"
 
              << "<h3>Recent History</h3>"
-             << g_db.GetHistoryHTML()
+             << g_db.GetHistoryHTML(sensor)
              
              << "</body></html>";
-
-        std::stringstream response;
-        response << "HTTP/1.1 200 OK\r\n"
-                 << "Content-Type: text/html; charset=utf-8\r\n"
-                 << "Content-Length: " << body.str().length() << "\r\n\r\n"
-                 << body.str();
-
-        send(client, response.str().c_str(), response.str().length(), 0);
-        CLOSE_SOCK(client);
+        return body.str();
     }
 };
 
 int main(int argc, char* argv[]) {
     if (argc < 3) {
-        std::cout << "Usage: server <UDP_PORT> <HTTP_PORT>" << std::endl;
+        std::cout << "Usage: server <UDP_PORT> <HTTP_PORT> [-raw DAYS] [-minute DAYS] [-hour DAYS]" << std::endl;
+        std::cout << "  retention per tier, 0 keeps forever (default: raw 7, minute 90, hour 0)" << std::endl;
         return 1;
     }
 
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-raw") == 0) g_db.retention.raw_days = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-minute") == 0) g_db.retention.minute_days = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-hour") == 0) g_db.retention.hour_days = atoi(argv[i + 1]);
+        else {
+            std::cout << "Unknown option " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
 #ifdef _WIN32
     WSADATA wsa;
     WSAStartup(MAKEWORD(2, 2), &wsa);
@@ -250,6 +1134,7 @@ int main(int argc, char* argv[]) {
     signal(SIGPIPE, SIG_IGN);
 #endif
     
+    g_clock.Tick();
     if (!g_db.Open("data.db")) return 1;
 
     UdpListener udp;
@@ -272,12 +1157,28 @@ int main(int argc, char* argv[]) {
     fds[1].fd = http.sock;
     fds[1].events = POLLIN;
 
+    time_t last_maintenance = 0;
+    bool retention_pending = false;
     while (true) {
         int ret = POLL_FUNC(fds, 2, 1000);
+        g_clock.Tick();
         if (ret > 0) {
             if (fds[0].revents & POLLIN) udp.Read();
             if (fds[1].revents & POLLIN) http.ProcessClient();
         }
+
+        time_t now = time(NULL);
+        if (now - last_maintenance >= 10) {
+            g_db.SealColdHours();
+            g_db.SaveSnapshotIfDue();
+            Archive archive;
+            if (g_exporter.Collect(archive) && g_db.AddArchive(archive)) {
+                std::cout << "Archived " << archive.rows << " rows to " << archive.file << std::endl;
+            }
+            last_maintenance = now;
+            retention_pending = true;
+        }
+        if (retention_pending) retention_pending = g_db.EnforceRetention();
     }
 
 #ifdef _WIN32
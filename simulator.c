@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+int g_baud = 9600;
 
 #ifdef _WIN32
     #include <windows.h>
@@ -10,6 +16,53 @@
     #define BAD_PORT INVALID_HANDLE_VALUE
     #define PAUSE(ms) Sleep(ms)
 
+    DWORD baud_constant(int baud) { return baud > 0 ? (DWORD)baud : 0; }
+
+    long long now_ns() {
+        LARGE_INTEGER f, c;
+        QueryPerformanceFrequency(&f);
+        QueryPerformanceCounter(&c);
+        return (long long)((double)c.QuadPart * 1e9 / (double)f.QuadPart);
+    }
+
+    typedef HANDLE MyThread;
+    typedef CRITICAL_SECTION MyLock;
+
+    typedef struct {
+        void (*fn)(void*);
+        void* arg;
+    } ThreadStart;
+
+    DWORD WINAPI thread_main(LPVOID p) {
+        ThreadStart start = *(ThreadStart*)p;
+        free(p);
+        start.fn(start.arg);
+        return 0;
+    }
+
+    MyThread start_thread(void (*fn)(void*), void* arg) {
+        ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+        start->fn = fn;
+        start->arg = arg;
+        return CreateThread(NULL, 0, thread_main, start, 0, NULL);
+    }
+
+    void join_thread(MyThread t) {
+        WaitForSingleObject(t, INFINITE);
+        CloseHandle(t);
+    }
+
+    void lock_init(MyLock* l) { InitializeCriticalSection(l); }
+    void lock(MyLock* l) { EnterCriticalSection(l); }
+    void unlock(MyLock* l) { LeaveCriticalSection(l); }
+
+    // Sleep() only has millisecond steps; whatever falls due meanwhile goes
+    // out together on the next pass.
+    void sleep_until_ns(long long deadline) {
+        long long left = deadline - now_ns();
+        if (left > 0) Sleep((DWORD)((left + 999999) / 1000000));
+    }
+
     MyPort connect_port(const char* name) {
         HANDLE h = CreateFileA(name,
             GENERIC_READ | GENERIC_WRITE,
@@ -26,7 +79,7 @@
         DCB cfg = {0};
         cfg.DCBlength = sizeof(cfg);
         GetCommState(h, &cfg);
-        cfg.BaudRate = CBR_9600;
+        cfg.BaudRate = baud_constant(g_baud);
         cfg.ByteSize = 8;
         cfg.StopBits = ONESTOPBIT;
         cfg.Parity = NOPARITY;
@@ -34,11 +87,17 @@
         return h;
     }
 
-    int send_data(MyPort p, const char* text) {
+    // Writes all of `data`, however many writes that takes, so a frame is
+    // never cut short on a shared link.
+    int send_data(MyPort p, const char* data, int len) {
         unsigned long written;
-        
-        if(!WriteFile(p, text, strlen(text), &written, NULL)) {
-            return 0;
+
+        while (len > 0) {
+            if(!WriteFile(p, data, len, &written, NULL) || written == 0) {
+                return 0;
+            }
+            data += written;
+            len -= (int)written;
         }
         return 1;
     }
@@ -49,25 +108,98 @@
 
 #else
     #include <unistd.h>
+    #include <errno.h>
     #include <fcntl.h>
     #include <termios.h>
+    #include <pthread.h>
 
     typedef int MyPort;
     #define BAD_PORT -1
     #define PAUSE(ms) usleep((ms) * 1000)
 
+    long long now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    typedef pthread_t MyThread;
+    typedef pthread_mutex_t MyLock;
+
+    typedef struct {
+        void (*fn)(void*);
+        void* arg;
+    } ThreadStart;
+
+    void* thread_main(void* p) {
+        ThreadStart start = *(ThreadStart*)p;
+        free(p);
+        start.fn(start.arg);
+        return NULL;
+    }
+
+    MyThread start_thread(void (*fn)(void*), void* arg) {
+        ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+        start->fn = fn;
+        start->arg = arg;
+        pthread_t t;
+        pthread_create(&t, NULL, thread_main, start);
+        return t;
+    }
+
+    void join_thread(MyThread t) { pthread_join(t, NULL); }
+
+    void lock_init(MyLock* l) { pthread_mutex_init(l, NULL); }
+    void lock(MyLock* l) { pthread_mutex_lock(l); }
+    void unlock(MyLock* l) { pthread_mutex_unlock(l); }
+
+    // Sleeps to an absolute deadline, so time spent generating and writing
+    // never adds up into drift.
+    void sleep_until_ns(long long deadline) {
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000;
+        ts.tv_nsec = deadline % 1000000000;
+        int rc;
+        while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR) {}
+        if (rc != 0) {
+            printf("clock_nanosleep failed: %s\n", strerror(rc));
+            exit(1);
+        }
+    }
+
+    speed_t baud_constant(int baud) {
+        switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+#ifdef B460800
+        case 460800: return B460800;
+#endif
+#ifdef B921600
+        case 921600: return B921600;
+#endif
+        }
+        return 0;
+    }
+
     MyPort connect_port(const char* name) {
         int id = open(name, O_RDWR | O_NOCTTY | O_NDELAY);
 
         if(id == -1) {
             return BAD_PORT;
         }
+        // O_NDELAY only keeps open() from waiting for carrier; writes must
+        // block when the line falls behind, not fail.
+        fcntl(id, F_SETFL, 0);
 
         struct termios cfg;
         
         tcgetattr(id, &cfg);
-        cfsetispeed(&cfg, B9600);
-        cfsetospeed(&cfg, B9600);
+        cfsetispeed(&cfg, baud_constant(g_baud));
+        cfsetospeed(&cfg, baud_constant(g_baud));
 
         cfg.c_cflag &= ~PARENB;
         cfg.c_cflag &= ~CSTOPB;
@@ -80,10 +212,17 @@
         return id;
     }
 
-    int send_data(MyPort p, const char* text) {
-        int len = strlen(text);
-        int real_sent = write(p, text, len);
-        return (real_sent == len); 
+    // Writes all of `data`, however many writes that takes, so a frame is
+    // never cut short on a shared link.
+    int send_data(MyPort p, const char* data, int len) {
+        int real_sent = 0;
+        while (real_sent < len) {
+            int n = write(p, data + real_sent, len - real_sent);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return 0;
+            real_sent += n;
+        }
+        return 1;
     }
 
     void disconnect(MyPort p) {
@@ -92,37 +231,311 @@
 
 #endif
 
-int main(int argc, char* argv[]) {
-    char* name = argv[1];
-    printf("connecting to %s\n", name);
+// splitmix64: the same seed gives the same signal on every platform,
+// unlike rand().
+uint64_t next_random(uint64_t* rng) {
+    uint64_t z = (*rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
 
-    MyPort p = connect_port(name);
-    if(p == BAD_PORT) {
-        printf("can't open port\n");
-        return 1;
+// Uniform in [0, 1).
+double uniform(uint64_t* rng) {
+    return (next_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double gaussian(uint64_t* rng) {
+    double u = uniform(rng), v = uniform(rng);
+    return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * 3.14159265358979 * v);
+}
+
+// The signal, as a sum of parts a real sensor shows. Time is the reading's
+// index over the rate, not the wall clock, so a seed always gives the same
+// sequence however fast it is sent.
+typedef struct {
+    double mean;
+    double diurnal;     // amplitude of the daily swing, lowest at time 0
+    double period;      // of that swing, seconds
+    double drift;       // per hour
+    double sigma;       // Gaussian noise
+    double spike_p;     // chance a reading is a spike...
+    double spike_size;  // ...off by up to this much either way
+    double dropout_p;   // chance a dropout starts at a reading...
+    long dropout_len;   // ...and silences this many
+    long dropping;      // readings left in the current dropout
+    uint64_t rng;
+} Signal;
+
+// Reading `i`; returns 0 when it falls in a dropout and isn't sent.
+int signal_next(Signal* g, long long i, double rate, double* value) {
+    double t = i / rate;
+    double v = g->mean - g->diurnal * cos(2.0 * 3.14159265358979 * t / g->period) + g->drift * t / 3600.0;
+    v += g->sigma * gaussian(&g->rng);
+    if (uniform(&g->rng) < g->spike_p) v += g->spike_size * (2.0 * uniform(&g->rng) - 1.0);
+    if (g->dropping == 0 && uniform(&g->rng) < g->dropout_p) g->dropping = g->dropout_len;
+    *value = v;
+    if (g->dropping == 0) return 1;
+    g->dropping--;
+    return 0;
+}
+
+// Flips a random bit in each byte with probability `rate`, like a noisy line.
+void add_noise(uint64_t* rng, char* data, int len, double rate) {
+    for (int i = 0; i < len; i++) {
+        if (uniform(rng) < rate) data[i] ^= (char)(1 << (next_random(rng) % 8));
     }
+}
+
+// "P" or "P,N" into p and n.
+void parse_pair(const char* arg, double* p, double* n) {
+    *p = atof(arg);
+    const char* comma = strchr(arg, ',');
+    if (comma) *n = atof(comma + 1);
+}
 
-    printf("started\n");
+// One emulated sensor. Reading i is due at start + (i + phase) / rate; the
+// phases spread the sensors evenly over a period instead of all firing at
+// once.
+typedef struct {
+    Signal g;
+    uint64_t line_rng;  // the noisy line's own, so readings don't depend on how they're encoded
+    MyPort port;
+    int channel;        // -1 unless it shares a framed link
+    double phase;
+    long long i;
+    volatile long long sent;
+} Sensor;
 
-    srand(time(NULL));
+// Settings every sensor shares.
+struct {
+    double rate;
+    long long count;    // per sensor, -1 for no end
+    int framed;
+    int decimals;
+    double noise;
+    int chatty;         // print every reading
+    MyPort link;        // the shared port when sensors are multiplexed
+    MyLock link_lock;
+    long long start;
+    volatile int failed;
+} g_run;
 
-    while(1) {
-        float t = 10.0 + (rand() % 200) / 10.0;
+// A worker thread drives every threads-th sensor from `first`.
+typedef struct {
+    Sensor* sensors;
+    int count;
+    int first;
+    int step;
+} Worker;
 
-        char msg[50];
-        sprintf(msg, "%.1f\n", t);
+int send_locked(MyPort p, const char* data, int len) {
+    lock(&g_run.link_lock);
+    int ok = send_data(p, data, len);
+    unlock(&g_run.link_lock);
+    return ok;
+}
 
-        if (send_data(p, msg)) {
-            printf("sent: %s", msg);
+long long due_ns(const Sensor* s) {
+    return g_run.start + (long long)((s->i + s->phase) * 1e9 / g_run.rate);
+}
+
+// Writes whatever its sensors have due, each port in one write and a shared
+// link in one write per pass, then sleeps to the next deadline among them.
+void run_worker(void* arg) {
+    Worker* w = (Worker*)arg;
+    char* buf = (char*)malloc(65536);
+    int cap = 65536 - FRAME_MAX - 32;
+    while (!g_run.failed) {
+        long long now = now_ns(), next = -1;
+        int len = 0, ok = 1;
+        for (int k = w->first; ok && k < w->count; k += w->step) {
+            Sensor* s = &w->sensors[k];
+            if (s->port != g_run.link) len = 0;
+            while ((g_run.count < 0 || s->i < g_run.count) && due_ns(s) <= now) {
+                double v;
+                int on = signal_next(&s->g, s->i, g_run.rate, &v);
+                s->i++;
+                if (!on) continue;
+                char* msg = buf + len;
+                int n = g_run.framed ? frame_encode((unsigned char*)msg, s->channel, (float)v)
+                                     : sprintf(msg, "%.*f\n", g_run.decimals, v);
+                if (g_run.noise > 0) add_noise(&s->line_rng, msg, n, g_run.noise);
+                len += n;
+                s->sent++;
+                if (g_run.chatty) printf("sent: %.*f\n", g_run.decimals, v);
+                if (len >= cap) {
+                    ok = s->port == g_run.link ? send_locked(s->port, buf, len) : send_data(s->port, buf, len);
+                    len = 0;
+                    if (!ok) break;
+                }
+            }
+            if (ok && len > 0 && s->port != g_run.link) ok = send_data(s->port, buf, len);
+            if (g_run.count < 0 || s->i < g_run.count) {
+                long long due = due_ns(s);
+                if (next < 0 || due < next) next = due;
+            }
         }
+        if (ok && len > 0 && g_run.link != BAD_PORT) ok = send_locked(g_run.link, buf, len);
+        if (!ok) {
+            printf("error sending\n");
+            g_run.failed = 1;
+        }
+        if (next < 0) break;
+        sleep_until_ns(next);
+    }
+    free(buf);
+}
 
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("usage: simulator <COM[,COM...]> [-sensors N] [-threads T] [-first ID] [-rate HZ] [-count N]\n"
+               "                 [-seed N] [-baud RATE] [-framed] [-noise P] [-decimals N] [-mean M]\n"
+               "                 [-diurnal A] [-period S] [-drift D] [-sigma SD] [-spikes P[,SIZE]]\n"
+               "                 [-dropouts P[,LEN]]\n");
+        printf("  COM list: one port per sensor, or a single framed port all sensors share\n");
+        printf("  -sensors N: independent sensors, each with its own seed and phase (default 1)\n");
+        printf("  -threads T: worker threads driving them (default: up to 4)\n");
+        printf("  -first ID: channel of the first sensor on a shared port (default 1)\n");
+        printf("  -rate HZ: readings per second per sensor, 0.01 to 100000 (default 1)\n");
+        printf("  -count N: stop after N readings per sensor (default: run until killed)\n");
+        printf("  -seed N: random seed, sensor k uses N + k; the same seeds and model give the\n");
+        printf("           same readings\n");
+        printf("  -baud RATE: serial speed, 9600 (default) to 921600\n");
+        printf("  -framed: send CRC-checked binary frames (see frame.h) instead of text lines\n");
+        printf("  -noise P: flip a random bit in each byte sent with probability P\n");
+        printf("  -decimals N: digits after the point in text lines (default 1)\n");
+        printf("  signal model, summed:\n");
+        printf("  -mean M: level (default 20)\n");
+        printf("  -diurnal A: daily swing of +-A around it, lowest at the start (default 5)\n");
+        printf("  -period S: length of that day in seconds, to compress it (default 86400)\n");
+        printf("  -drift D: change per hour (default 0)\n");
+        printf("  -sigma SD: Gaussian measurement noise (default 0.1)\n");
+        printf("  -spikes P[,SIZE]: chance a reading is off by up to +-SIZE (default 0, 10)\n");
+        printf("  -dropouts P[,LEN]: chance per reading the sensor goes silent for LEN readings (default 0, 100)\n");
+        return 1;
+    }
+    int sensors = 1, threads = 0, first = 1;
+    double dropout_len = 100;
+    uint64_t seed = (uint64_t)time(NULL);
+    Signal g = { 20, 5, 86400, 0, 0.1, 0, 10, 0, 100, 0, 0 };
+    g_run.rate = 1;
+    g_run.count = -1;
+    g_run.decimals = 1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-sensors") == 0 && i + 1 < argc) sensors = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-first") == 0 && i + 1 < argc) first = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc) g_run.rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-count") == 0 && i + 1 < argc) g_run.count = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-baud") == 0 && i + 1 < argc) g_baud = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-framed") == 0) g_run.framed = 1;
+        else if (strcmp(argv[i], "-noise") == 0 && i + 1 < argc) g_run.noise = atof(argv[++i]);
+        else if (strcmp(argv[i], "-decimals") == 0 && i + 1 < argc) g_run.decimals = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-mean") == 0 && i + 1 < argc) g.mean = atof(argv[++i]);
+        else if (strcmp(argv[i], "-diurnal") == 0 && i + 1 < argc) g.diurnal = atof(argv[++i]);
+        else if (strcmp(argv[i], "-period") == 0 && i + 1 < argc) g.period = atof(argv[++i]);
+        else if (strcmp(argv[i], "-drift") == 0 && i + 1 < argc) g.drift = atof(argv[++i]);
+        else if (strcmp(argv[i], "-sigma") == 0 && i + 1 < argc) g.sigma = atof(argv[++i]);
+        else if (strcmp(argv[i], "-spikes") == 0 && i + 1 < argc) parse_pair(argv[++i], &g.spike_p, &g.spike_size);
+        else if (strcmp(argv[i], "-dropouts") == 0 && i + 1 < argc) parse_pair(argv[++i], &g.dropout_p, &dropout_len);
         else {
-            printf("error sending\n");
-            break;
+            printf("unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    g.dropout_len = (long)dropout_len;
+    if (baud_constant(g_baud) == 0) {
+        printf("unsupported baud rate %d\n", g_baud);
+        return 1;
+    }
+    if (g_run.rate < 0.01 || g_run.rate > 100000) {
+        printf("rate must be 0.01 to 100000\n");
+        return 1;
+    }
+    if (g.period <= 0 || g_run.decimals < 0 || g_run.decimals > 6) {
+        printf("bad -period or -decimals\n");
+        return 1;
+    }
+    if (sensors < 1 || sensors > 10000 || first < 0 || first + sensors > 65536) {
+        printf("sensors must be 1 to 10000, with channels up to 65535\n");
+        return 1;
+    }
+    if (threads < 1) threads = sensors < 4 ? sensors : 4;
+    if (threads > sensors) threads = sensors;
+
+    int ports = 1;
+    for (const char* c = argv[1]; *c; c++) ports += (*c == ',');
+    if (ports != sensors && (ports != 1 || !g_run.framed)) {
+        printf("give one port per sensor, or one port with -framed to share it\n");
+        return 1;
+    }
+
+    Sensor* s = (Sensor*)calloc(sensors, sizeof(Sensor));
+    g_run.link = BAD_PORT;
+    lock_init(&g_run.link_lock);
+    char* name = strtok(argv[1], ",");
+    for (int k = 0; k < sensors; k++) {
+        if (k == 0 || ports > 1) {
+            printf("connecting to %s\n", name);
+            s[k].port = connect_port(name);
+            if (s[k].port == BAD_PORT) {
+                printf("can't open port\n");
+                return 1;
+            }
+            name = strtok(NULL, ",");
+        } else {
+            s[k].port = s[0].port;
         }
+        s[k].channel = ports == 1 && sensors > 1 ? first + k : -1;
+        s[k].phase = (double)k / sensors;
+        s[k].g = g;
+        s[k].g.rng = seed + k;
+        s[k].line_rng = ~(seed + k);
+    }
+    if (ports == 1 && sensors > 1) g_run.link = s[0].port;
+    g_run.chatty = sensors == 1 && g_run.rate <= 10;
 
-        PAUSE(1000);
+    printf("started %d sensor(s) on %d thread(s), seed %llu\n", sensors, threads, (unsigned long long)seed);
+    g_run.start = now_ns();
+    Worker* workers = (Worker*)calloc(threads, sizeof(Worker));
+    MyThread* running = (MyThread*)calloc(threads, sizeof(MyThread));
+    for (int t = 0; t < threads; t++) {
+        workers[t].sensors = s;
+        workers[t].count = sensors;
+        workers[t].first = t;
+        workers[t].step = threads;
+        running[t] = start_thread(run_worker, &workers[t]);
     }
-    disconnect(p);
-    return 0;
-}
\ No newline at end of file
+
+    // Progress once a second unless every reading is printed. Counts are
+    // read while workers update them; a stale one only delays the figure.
+    long long shown = 0, reported = g_run.start;
+    long long total = g_run.count < 0 ? -1 : g_run.count * sensors;
+    while (!g_run.chatty && !g_run.failed) {
+        long long sent = 0, done = 0;
+        for (int k = 0; k < sensors; k++) {
+            sent += s[k].sent;
+            done += s[k].i;
+        }
+        long long now = now_ns();
+        if (now - reported >= 1000000000) {
+            printf("sent %lld readings in %.2f s\n", sent - shown, (now - reported) / 1e9);
+            shown = sent;
+            reported = now;
+        }
+        if (total >= 0 && done >= total) break;
+        sleep_until_ns(now + 100000000);
+    }
+    for (int t = 0; t < threads; t++) join_thread(running[t]);
+
+    disconnect(s[0].port);
+    for (int k = 1; k < sensors; k++) {
+        if (s[k].port != s[0].port) disconnect(s[k].port);
+    }
+    free(running);
+    free(workers);
+    free(s);
+    return g_run.failed;
+}
@@ -0,0 +1,1954 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+// Storage engine shared by the server and the bulk loader: the block codec,
+// day partitions, rollups with their sketches, the in-memory tail and ring,
+// snapshots, retention and Parquet archives, all behind class DB.
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <ctime>
+#include <cmath>
+#include <chrono>
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sqlite3.h"
+#include "parquet.h"
+
+// Sealed hours are moved out of `log` into `blocks`, one compressed row per
+// hour and sensor: delta-of-delta timestamps and fixed-point (0.01 °C) value
+// deltas, bit-packed the way Gorilla does it. A steady once-a-second reading costs
+// two bits instead of a full SQLite row.
+struct Sample {
+    int64_t time;    // epoch milliseconds
+    int64_t value;   // hundredths of a degree
+    int64_t repeats; // further readings of about this value it stands for, up to `time`
+    int sensor;      // probe it came from; untagged readings are sensor 0
+
+    // Readings this sample counts as in aggregates. A sender with a deadband
+    // sends one reading for a run it held back, so the run still counts.
+    int64_t Count() const { return 1 + repeats; }
+};
+
+const int64_t MS_PER_MINUTE = 60 * 1000;
+const int64_t MS_PER_HOUR = 60 * MS_PER_MINUTE;
+const int64_t MS_PER_DAY = 24 * MS_PER_HOUR;
+
+inline int64_t ToFixed(double temp) { return (int64_t)llround(temp * 100.0); }
+inline double FromFixed(int64_t value) { return value / 100.0; }
+
+class BitWriter {
+public:
+    std::string out;
+    int used;
+
+    BitWriter() : used(8) {}
+
+    void Put(uint64_t bits, int n) {
+        while (n > 0) {
+            if (used == 8) { out.push_back(0); used = 0; }
+            int take = std::min(n, 8 - used);
+            uint8_t chunk = (uint8_t)((bits >> (n - take)) & ((1u << take) - 1));
+            out[out.size() - 1] |= (char)(chunk << (8 - used - take));
+            used += take;
+            n -= take;
+        }
+    }
+
+    // Zigzag the value, then spend 1, 9, 12, 16 or 68 bits depending on size.
+    void PutSigned(int64_t v) {
+        uint64_t z = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+        if (z == 0)               Put(0x0, 1);
+        else if (z < (1u << 7))   { Put(0x2, 2); Put(z, 7); }
+        else if (z < (1u << 9))   { Put(0x6, 3); Put(z, 9); }
+        else if (z < (1u << 12))  { Put(0xE, 4); Put(z, 12); }
+        else                      { Put(0xF, 4); Put(z, 64); }
+    }
+};
+
+class BitReader {
+public:
+    const uint8_t* data;
+    size_t size;
+    size_t pos; // in bits
+
+    BitReader(const void* d, size_t n) : data((const uint8_t*)d), size(n), pos(0) {}
+
+    bool Get(int n, uint64_t& bits) {
+        if (pos + n > size * 8) return false;
+        bits = 0;
+        while (n > 0) {
+            int used = pos % 8;
+            int take = std::min(n, 8 - used);
+            uint8_t chunk = (data[pos / 8] >> (8 - used - take)) & ((1u << take) - 1);
+            bits = (bits << take) | chunk;
+            pos += take;
+            n -= take;
+        }
+        return true;
+    }
+
+    bool GetSigned(int64_t& v) {
+        uint64_t bit, z = 0;
+        int width = 64;
+        if (!Get(1, bit)) return false;
+        if (bit == 0) { v = 0; return true; }
+        if (!Get(1, bit)) return false;
+        if (bit == 0) width = 7;
+        else {
+            if (!Get(1, bit)) return false;
+            if (bit == 0) width = 9;
+            else {
+                if (!Get(1, bit)) return false;
+                width = (bit == 0) ? 12 : 64;
+            }
+        }
+        if (!Get(width, z)) return false;
+        v = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+        return true;
+    }
+};
+
+// Format 2 adds each sample's repeat count after its value; blocks where every
+// count is zero stay format 1 and cost nothing extra.
+const uint8_t BLOCK_FORMAT = 1;
+const uint8_t BLOCK_FORMAT_REPEATS = 2;
+
+inline std::string EncodeBlock(const std::vector<Sample>& samples) {
+    BitWriter w;
+    bool repeats = false;
+    for (size_t i = 0; i < samples.size() && !repeats; i++) repeats = samples[i].repeats != 0;
+    w.Put(repeats ? BLOCK_FORMAT_REPEATS : BLOCK_FORMAT, 8);
+    w.Put(samples.size(), 32);
+    int64_t prev_time = 0, prev_delta = 0, prev_value = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        const Sample& s = samples[i];
+        if (i == 0) {
+            w.Put((uint64_t)s.time, 64);
+            w.Put((uint64_t)s.value, 64);
+        } else {
+            int64_t delta = s.time - prev_time;
+            w.PutSigned(delta - prev_delta);
+            w.PutSigned(s.value - prev_value);
+            prev_delta = delta;
+        }
+        if (repeats) w.PutSigned(s.repeats);
+        prev_time = s.time;
+        prev_value = s.value;
+    }
+    return w.out;
+}
+
+inline bool DecodeBlock(const void* data, size_t size, std::vector<Sample>& out) {
+    BitReader r(data, size);
+    uint64_t format, count, bits;
+    if (!r.Get(8, format) || (format != BLOCK_FORMAT && format != BLOCK_FORMAT_REPEATS)) return false;
+    if (!r.Get(32, count)) return false;
+    out.reserve(out.size() + count);
+    Sample s = {0, 0, 0, 0};
+    int64_t delta = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (i == 0) {
+            if (!r.Get(64, bits)) return false;
+            s.time = (int64_t)bits;
+            if (!r.Get(64, bits)) return false;
+            s.value = (int64_t)bits;
+        } else {
+            int64_t dod, dv;
+            if (!r.GetSigned(dod) || !r.GetSigned(dv)) return false;
+            delta += dod;
+            s.time += delta;
+            s.value += dv;
+        }
+        if (format == BLOCK_FORMAT_REPEATS && !r.GetSigned(s.repeats)) return false;
+        out.push_back(s);
+    }
+    return true;
+}
+
+// Wall-clock milliseconds that never step backwards. The wall clock is read
+// once and then advanced from the monotonic clock; Tick() re-anchors it to
+// the wall clock every minute but only lets it move forward. Now() is the
+// value cached by the last Tick(), so a burst of datagrams handled in one
+// loop iteration costs a single clock read.
+class Clock {
+public:
+    std::chrono::steady_clock::time_point base;
+    int64_t base_ms;
+    int64_t now_ms;
+
+    Clock() : now_ms(0) { Anchor(); }
+
+    void Anchor() {
+        base = std::chrono::steady_clock::now();
+        base_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void Tick() {
+        std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+        if (t - base > std::chrono::minutes(1)) {
+            Anchor();
+            t = base;
+        }
+        int64_t ms = base_ms + std::chrono::duration_cast<std::chrono::milliseconds>(t - base).count();
+        now_ms = std::max(now_ms, ms);
+    }
+
+    int64_t Now() const { return now_ms; }
+};
+
+// Defined once by each program that includes this header.
+extern Clock g_clock;
+
+// Raw data is partitioned by UTC day: log_YYYYMMDD holds the day's unsealed
+// rows and blocks_YYYYMMDD its sealed hours. Queries only open partitions
+// that overlap their range, and raw retention drops whole days.
+inline std::string PartitionName(const char* prefix, int64_t day) {
+    time_t t = (time_t)(day * (MS_PER_DAY / 1000));
+    struct tm* tm_info = gmtime(&t);
+    char buf[64];
+    sprintf(buf, "%s_%04d%02d%02d", prefix, tm_info->tm_year + 1900, tm_info->tm_mon + 1, tm_info->tm_mday);
+    return buf;
+}
+
+// Table layouts: each sensor keeps a series of its own in the log partitions,
+// the blocks and the rollups.
+const char* const LOG_COLUMNS = "(time INTEGER, temp INTEGER, repeats INTEGER NOT NULL DEFAULT 0, sensor INTEGER NOT NULL DEFAULT 0)";
+const char* const BLOCK_COLUMNS = "(hour INTEGER, sensor INTEGER NOT NULL DEFAULT 0, n INTEGER, data BLOB, PRIMARY KEY (hour, sensor))";
+const char* const ROLLUP_COLUMNS = "(bucket INTEGER, sensor INTEGER NOT NULL DEFAULT 0, n INTEGER, sum INTEGER, min INTEGER, "
+                                   "max INTEGER, hist BLOB, PRIMARY KEY (bucket, sensor))";
+
+// Scans given this instead of a sensor id return every sensor's samples.
+const int ALL_SENSORS = -1;
+
+// "2024-05-01T10:00Z", with seconds and milliseconds only when needed.
+inline std::string FormatUtc(int64_t ms) {
+    time_t t = (time_t)(ms / 1000 - (ms % 1000 < 0));
+    struct tm* tm_info = gmtime(&t);
+    char buf[64];
+    int len = (int)strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M", tm_info);
+    if (ms % MS_PER_MINUTE != 0) {
+        len += sprintf(buf + len, ":%02d", tm_info->tm_sec);
+        if (ms % 1000 != 0) len += sprintf(buf + len, ".%03d", (int)(((ms % 1000) + 1000) % 1000));
+    }
+    strcpy(buf + len, "Z");
+    return buf;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date.
+inline int64_t DayFromDate(int y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Count, sum, min and max of a run of samples; what rollup rows store.
+struct Summary {
+    int64_t n, sum, min, max;
+
+    Summary() : n(0), sum(0), min(INT64_MAX), max(INT64_MIN) {}
+
+    void Add(int64_t value, int64_t count = 1) {
+        n += count;
+        sum += value * count;
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+
+    void Merge(const Summary& o) {
+        n += o.n;
+        sum += o.sum;
+        min = std::min(min, o.min);
+        max = std::max(max, o.max);
+    }
+};
+
+inline void PutVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+inline bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// Distribution sketch kept next to each rollup: a fixed-bin histogram over
+// the sensor range, one bin per 0.1 degree from -50 to +150 (readings outside
+// land in the end bins). Sketches merge by adding counts, so percentiles of
+// any window come from the handful of rollups covering it, exact to the
+// sensor's resolution. Stored sparse as varint (bin gap, count) pairs; in
+// memory only the range of bins between the lowest and highest reading is
+// kept, a handful for a minute of one sensor rather than all 2000.
+class Histogram {
+public:
+    static const int64_t LOW = -5000;
+    static const int64_t BIN = 10;
+    static const int BINS = 2000;
+
+    std::vector<uint32_t> counts; // bins first .. first + counts.size() - 1
+    int first;
+    int64_t total;
+
+    Histogram() : first(0), total(0) {}
+
+    void Add(int64_t value, uint32_t count = 1) {
+        int64_t bin = (value - LOW) / BIN;
+        AddBin((int)std::max<int64_t>(0, std::min<int64_t>(BINS - 1, bin)), count);
+    }
+
+    // Widens the kept range to `bin` if needed.
+    void AddBin(int bin, uint32_t count) {
+        if (counts.empty()) {
+            first = bin;
+            counts.assign(1, 0);
+        } else if (bin < first) {
+            counts.insert(counts.begin(), first - bin, 0);
+            first = bin;
+        } else if (bin >= first + (int)counts.size()) {
+            counts.resize(bin - first + 1, 0);
+        }
+        counts[bin - first] += count;
+        total += count;
+    }
+
+    void Merge(const Histogram& o) {
+        for (size_t i = 0; i < o.counts.size(); i++) {
+            if (o.counts[i]) AddBin(o.first + (int)i, o.counts[i]);
+        }
+    }
+
+    std::string Encode() const {
+        std::string out;
+        int prev = -1;
+        for (size_t i = 0; i < counts.size(); i++) {
+            if (!counts[i]) continue;
+            PutVarint(out, first + (int)i - prev);
+            PutVarint(out, counts[i]);
+            prev = first + (int)i;
+        }
+        return out;
+    }
+
+    // Adds an encoded sketch to this one.
+    bool Decode(const void* data, size_t size) {
+        const uint8_t* p = (const uint8_t*)data;
+        const uint8_t* end = p + size;
+        int64_t bin = -1;
+        while (p < end) {
+            uint64_t gap, count;
+            if (!GetVarint(p, end, gap) || !GetVarint(p, end, count)) return false;
+            bin += gap;
+            if (bin < 0 || bin >= BINS) return false;
+            AddBin((int)bin, (uint32_t)count);
+        }
+        return true;
+    }
+
+    // Value at quantile q (0..1), as the lower edge of its bin.
+    int64_t Percentile(double q) const {
+        int64_t rank = (int64_t)ceil(q * total);
+        int64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) return LOW + (int64_t)(first + (int)i) * BIN;
+        }
+        return LOW + (BINS - 1) * BIN;
+    }
+};
+
+// The newest readings, kept in memory so the dashboard never goes to SQLite
+// for them. One writer (the ingest path) and any number of readers, none of
+// which take a lock: the writer makes `seq` odd while it fills a slot and
+// even again afterwards, readers copy what they need and retry if `seq`
+// moved underneath them.
+template <int N>
+class RecentRing {
+public:
+    std::atomic<uint64_t> seq; // twice the number of pushes, odd mid-push
+    std::atomic<int64_t> times[N];
+    std::atomic<int64_t> values[N];
+
+    RecentRing() : seq(0) {}
+
+    void Push(const Sample& s) {
+        uint64_t q = seq.load(std::memory_order_relaxed);
+        seq.store(q + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        size_t slot = (q / 2) % N;
+        times[slot].store(s.time, std::memory_order_relaxed);
+        values[slot].store(s.value, std::memory_order_relaxed);
+        seq.store(q + 2, std::memory_order_release);
+    }
+
+    // Up to `count` newest samples, newest first.
+    std::vector<Sample> Latest(int count) const {
+        std::vector<Sample> out;
+        while (true) {
+            uint64_t q = seq.load(std::memory_order_acquire);
+            if (q & 1) continue;
+            uint64_t pushed = q / 2;
+            uint64_t n = std::min<uint64_t>(std::min<uint64_t>(count, N), pushed);
+            out.resize(n);
+            for (uint64_t i = 0; i < n; i++) {
+                size_t slot = (pushed - 1 - i) % N;
+                out[i].time = times[slot].load(std::memory_order_relaxed);
+                out[i].value = values[slot].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == q) return out;
+        }
+    }
+};
+
+// Minute aggregates of the rows still waiting in log partitions. Rollups
+// only cover sealed rows, so queries add these instead of scanning the
+// unsealed tail.
+struct TailBucket {
+    Summary summary;
+    Histogram hist;
+};
+
+inline void PutSignedVarint(std::string& out, int64_t v) {
+    PutVarint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+inline bool GetSignedVarint(const uint8_t*& p, const uint8_t* end, int64_t& v) {
+    uint64_t z;
+    if (!GetVarint(p, end, z)) return false;
+    v = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+    return true;
+}
+
+inline uint32_t Crc32(const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// How long each tier is kept, in days; 0 keeps it forever. Raw data (log and
+// blocks) is downsampled into minute and hour rollups when an hour is sealed.
+struct Retention {
+    int raw_days;
+    int minute_days;
+    int hour_days;
+};
+
+// Storage tiers from coarsest to finest. Day rollups are kept forever; raw
+// is the blocks and log partitions. Archives stand in for raw data that
+// retention has already dropped.
+struct Tier {
+    const char* name;
+    const char* table;
+    int64_t unit;
+};
+
+const int TIER_DAY = 0, TIER_HOUR = 1, TIER_MINUTE = 2, TIER_RAW = 3, TIER_ARCHIVE = 4;
+const Tier TIERS[] = {
+    { "day", "rollup_day", MS_PER_DAY },
+    { "hour", "rollup_hour", MS_PER_HOUR },
+    { "minute", "rollup_minute", MS_PER_MINUTE },
+    { "raw", nullptr, 1 },
+    { "archive", nullptr, 1 },
+};
+
+// A Parquet file holding every sample of [from, to), registered in the
+// `archives` table once written.
+struct Archive {
+    std::string file;
+    int64_t from, to;
+    int64_t rows;
+};
+
+// Exactly-once bookkeeping for one reliable sender (see protocol.h): every
+// sequence number below `acked` is stored, and `seen` marks the ones stored
+// in the WINDOW above it. Readings further ahead are refused until the gap
+// before them fills in; the sender replays them.
+struct Delivery {
+    static const uint64_t WINDOW = 8192;
+    uint64_t acked;
+    unsigned char seen[WINDOW / 8];
+
+    Delivery() : acked(0) { memset(seen, 0, sizeof(seen)); }
+
+    bool Seen(uint64_t seq) const {
+        return seq < acked || (seq - acked < WINDOW && (seen[seq % WINDOW / 8] >> (seq % 8)) & 1);
+    }
+    bool Fits(uint64_t seq) const { return seq >= acked && seq - acked < WINDOW; }
+    void Mark(uint64_t seq) { seen[seq % WINDOW / 8] |= (unsigned char)(1 << (seq % 8)); }
+
+    // Moves `acked` past everything stored, and past `base`: the sender no
+    // longer holds what is below it, so waiting for that is pointless.
+    void Advance(uint64_t base) {
+        if (base > acked && base - acked >= WINDOW) {
+            memset(seen, 0, sizeof(seen));
+            acked = base;
+        }
+        while (acked < base || Seen(acked)) {
+            seen[acked % WINDOW / 8] &= (unsigned char)~(1 << (acked % 8));
+            acked++;
+        }
+    }
+};
+
+// One piece of a query plan: [from, to) read from one tier. A widened step
+// covers whole buckets past the requested range because the finer data it
+// would need has expired.
+struct PlanStep {
+    int tier;
+    int64_t from, to;
+    int64_t cost;
+    bool widened;
+};
+
+// Plan costs are estimated rows touched. A step also pays a fixed price for
+// its statements, widened steps lose to any exact plan, and impossible ones
+// (expired data) lose to everything.
+const int64_t PLAN_STEP_COST = 8;
+const int64_t PLAN_WIDENED = (int64_t)1 << 40;
+const int64_t PLAN_IMPOSSIBLE = (int64_t)1 << 50;
+
+class DB {
+public:
+    sqlite3* db;
+    std::string path;
+    sqlite3_stmt* insert_stmt;
+    int64_t insert_day;
+    std::vector<int64_t> partitions; // days, ascending
+    // A ring per sensor, added by the ingest path when the sensor first
+    // reports. Only the map itself needs the main thread.
+    std::map<int, RecentRing<64>> recent;
+    std::map<std::pair<int, int64_t>, TailBucket> tail; // by sensor, then minute
+    Retention retention;
+    bool verbose; // print each sealed hour
+    std::vector<Archive> archives; // by `from`
+    // When the last insert committed, and when its readings reached the
+    // rings of latest ones that GetLastRecord reads.
+    std::chrono::steady_clock::time_point committed, published;
+
+    // Bumped (in data.db) by every transaction that moves rows out of the log
+    // partitions; a snapshot is only valid for the generation it was taken at.
+    int64_t generation;
+    std::string snapshot_path;
+    int64_t snapshot_generation;
+    int64_t snapshot_time;
+
+    // Totals of the retention pass in progress, reported when it finishes.
+    int64_t reclaim_raw, reclaim_minute, reclaim_hour, reclaim_start_bytes;
+
+    DB() : db(nullptr), insert_stmt(nullptr), insert_day(INT64_MIN), verbose(true),
+           generation(0), snapshot_generation(-1), snapshot_time(0), reclaim_raw(0), reclaim_minute(0), reclaim_hour(0), reclaim_start_bytes(-1) {
+        retention.raw_days = 7;
+        retention.minute_days = 90;
+        retention.hour_days = 0;
+    }
+    ~DB() {
+        sqlite3_finalize(insert_stmt);
+        if (db) sqlite3_close(db);
+    }
+
+    bool Exec(const char* sql) {
+        char* errMsg = 0;
+        if (sqlite3_exec(db, sql, 0, 0, &errMsg) != SQLITE_OK) {
+            std::cout << "DB Error: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        return true;
+    }
+
+    bool Open(const char* filename) {
+        if (sqlite3_open(filename, &db) != SQLITE_OK) {
+            std::cout << "DB Error: Can't open database file!" << std::endl;
+            return false;
+        }
+        path = filename;
+        // WAL lets readers on other connections (online backup) keep a
+        // consistent snapshot without ever blocking inserts.
+        Exec("PRAGMA journal_mode = WAL;");
+        // Retention frees pages with incremental vacuum, which needs this mode.
+        // Files created before it was set are rebuilt once.
+        if (QueryInt("PRAGMA auto_vacuum;") != 2) {
+            Exec("PRAGMA auto_vacuum = INCREMENTAL;");
+            if (QueryInt("PRAGMA page_count;") > 0) {
+                std::cout << "Converting data.db to incremental vacuum..." << std::endl;
+                Exec("VACUUM;");
+            }
+        }
+
+        if (!Migrate()) return false;
+
+        std::string sql = std::string("CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value INTEGER);"
+                                      "INSERT OR IGNORE INTO meta VALUES ('generation', 0);"
+                                      "CREATE TABLE IF NOT EXISTS rollup_minute ") + ROLLUP_COLUMNS + ";"
+                          "CREATE TABLE IF NOT EXISTS rollup_hour " + ROLLUP_COLUMNS + ";"
+                          "CREATE TABLE IF NOT EXISTS rollup_day " + ROLLUP_COLUMNS + ";"
+                          "CREATE TABLE IF NOT EXISTS archives (file TEXT PRIMARY KEY, from_time INTEGER, to_time INTEGER, rows INTEGER);"
+                          "CREATE TABLE IF NOT EXISTS senders (id INTEGER PRIMARY KEY, acked INTEGER, window BLOB);";
+        char* errMsg = 0;
+        if (sqlite3_exec(db, sql.c_str(), 0, 0, &errMsg) != SQLITE_OK) {
+            std::cout << "DB Init Error: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        Exec("PRAGMA user_version = 10;");
+        LoadPartitions();
+        LoadArchives();
+        if (!BackfillRollups()) return false;
+        generation = QueryInt("SELECT value FROM meta WHERE key = 'generation';");
+
+        snapshot_path = std::string(filename) + ".snap";
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        int64_t replayed = LoadSnapshot();
+        if (replayed < 0) {
+            replayed = Replay(std::map<int64_t, int64_t>(), false);
+            std::vector<int> sensors = StoredSensors();
+            for (size_t k = 0; k < sensors.size(); k++) {
+                std::vector<Sample> latest = GetLatest(sensors[k], 64);
+                for (size_t i = latest.size(); i > 0; i--) recent[sensors[k]].Push(latest[i - 1]);
+            }
+        }
+        std::cout << "Loaded " << tail.size() << " unsealed minutes (" << replayed << " rows replayed) in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - started).count() << " ms" << std::endl;
+        return true;
+    }
+
+    // For readers on other threads: no schema changes, no tail or ring.
+    bool OpenReadOnly(const char* filename) {
+        if (sqlite3_open_v2(filename, &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            std::cout << "DB Error: Can't open database file!" << std::endl;
+            return false;
+        }
+        path = filename;
+        sqlite3_busy_timeout(db, 1000);
+        LoadPartitions();
+        return true;
+    }
+
+    void LoadArchives() {
+        archives.clear();
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "SELECT file, from_time, to_time, rows FROM archives ORDER BY from_time;",
+                               -1, &stmt, 0) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                Archive a = { (const char*)sqlite3_column_text(stmt, 0), sqlite3_column_int64(stmt, 1),
+                              sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3) };
+                archives.push_back(a);
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    bool AddArchive(const Archive& a) {
+        sqlite3_stmt* stmt;
+        bool ok = false;
+        if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO archives VALUES (?, ?, ?, ?);", -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, a.file.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 2, a.from);
+            sqlite3_bind_int64(stmt, 3, a.to);
+            sqlite3_bind_int64(stmt, 4, a.rows);
+            ok = (sqlite3_step(stmt) == SQLITE_DONE);
+        }
+        sqlite3_finalize(stmt);
+        if (ok) LoadArchives();
+        return ok;
+    }
+
+    bool HasColumn(const std::string& table, const char* column) {
+        sqlite3_stmt* stmt;
+        bool found = false;
+        std::string sql = "SELECT 1 FROM pragma_table_info('" + table + "') WHERE name = ?;";
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, column, -1, SQLITE_STATIC);
+            found = (sqlite3_step(stmt) == SQLITE_ROW);
+        }
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+    // Every sensor with sealed or unsealed data, ascending.
+    std::vector<int> StoredSensors() {
+        std::vector<int> sensors;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "SELECT DISTINCT sensor FROM rollup_day;", -1, &stmt, 0) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) sensors.push_back(sqlite3_column_int(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+        for (std::map<std::pair<int, int64_t>, TailBucket>::const_iterator it = tail.begin(); it != tail.end(); ++it) {
+            sensors.push_back(it->first.first);
+        }
+        std::sort(sensors.begin(), sensors.end());
+        sensors.erase(std::unique(sensors.begin(), sensors.end()), sensors.end());
+        return sensors;
+    }
+
+    bool HasTable(const char* name) {
+        sqlite3_stmt* stmt;
+        bool found = false;
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;", -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+            found = (sqlite3_step(stmt) == SQLITE_ROW);
+        }
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+    void LoadPartitions() {
+        partitions.clear();
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB 'log_[0-9]*';";
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                int y, m, d;
+                if (sscanf((const char*)sqlite3_column_text(stmt, 0), "log_%4d%2d%2d", &y, &m, &d) == 3) {
+                    partitions.push_back(DayFromDate(y, m, d));
+                }
+            }
+        }
+        sqlite3_finalize(stmt);
+        std::sort(partitions.begin(), partitions.end());
+    }
+
+    bool EnsurePartition(int64_t day) {
+        if (std::binary_search(partitions.begin(), partitions.end(), day)) return true;
+        std::string sql = "CREATE TABLE IF NOT EXISTS " + PartitionName("log", day) + " " + LOG_COLUMNS + ";"
+                          "CREATE TABLE IF NOT EXISTS " + PartitionName("blocks", day) + " " + BLOCK_COLUMNS + ";";
+        if (!Exec(sql.c_str())) return false;
+        partitions.insert(std::upper_bound(partitions.begin(), partitions.end(), day), day);
+        return true;
+    }
+
+    // Partitions overlapping [from, to), oldest first.
+    std::vector<int64_t> PartitionsIn(int64_t from, int64_t to) {
+        std::vector<int64_t> result;
+        for (size_t i = 0; i < partitions.size(); i++) {
+            if (partitions[i] >= from / MS_PER_DAY && partitions[i] <= (to - 1) / MS_PER_DAY) {
+                result.push_back(partitions[i]);
+            }
+        }
+        return result;
+    }
+
+    // Drops a whole day of raw data; returns how many rows it held. Rows not
+    // sealed yet (a backlog from before an upgrade or downtime, or stragglers
+    // for an expired day) are sealed first so their rollups are kept.
+    int64_t DropPartition(int64_t day) {
+        std::string log = PartitionName("log", day), blocks = PartitionName("blocks", day);
+        std::vector<int64_t> sealed;
+        if (!Exec("BEGIN;")) return 0;
+        bool ok = SealPartition(day, (day + 1) * MS_PER_DAY, sealed);
+        int64_t rows = QueryInt(("SELECT SUM(n) FROM " + blocks + ";").c_str());
+        if (!ok || !Exec(("DROP TABLE " + log + "; DROP TABLE " + blocks + ";"
+                          "UPDATE meta SET value = value + 1 WHERE key = 'generation'; COMMIT;").c_str())) {
+            std::cout << "Retention Error: " << sqlite3_errmsg(db) << std::endl;
+            Exec("ROLLBACK;");
+            return 0;
+        }
+        generation++;
+        partitions.erase(std::find(partitions.begin(), partitions.end(), day));
+        if (insert_day == day) {
+            sqlite3_finalize(insert_stmt);
+            insert_stmt = nullptr;
+            insert_day = INT64_MIN;
+        }
+        DropTail(day * MS_PER_DAY / MS_PER_MINUTE, (day + 1) * MS_PER_DAY / MS_PER_MINUTE);
+        return rows;
+    }
+
+    void AddTail(const Sample& s) {
+        TailBucket& b = tail[std::make_pair(s.sensor, s.time / MS_PER_MINUTE)];
+        b.summary.Add(s.value, s.Count());
+        b.hist.Add(s.value, (uint32_t)s.Count());
+    }
+
+    // Drops [from_minute, to_minute) of every sensor.
+    void DropTail(int64_t from_minute, int64_t to_minute) {
+        std::map<std::pair<int, int64_t>, TailBucket>::iterator it = tail.begin();
+        while (it != tail.end()) {
+            int sensor = it->first.first;
+            tail.erase(tail.lower_bound(std::make_pair(sensor, from_minute)), tail.lower_bound(std::make_pair(sensor, to_minute)));
+            it = tail.upper_bound(std::make_pair(sensor, INT64_MAX));
+        }
+    }
+
+    // Up to `count` newest samples of `sensor` from its ring, newest first.
+    std::vector<Sample> Recent(int sensor, int count) {
+        std::vector<Sample> out;
+        std::map<int, RecentRing<64>>::const_iterator it = recent.find(sensor);
+        if (it != recent.end()) out = it->second.Latest(count);
+        for (size_t i = 0; i < out.size(); i++) out[i].sensor = sensor;
+        return out;
+    }
+
+    // Adds the log rows past each partition's watermark (max rowid already
+    // accounted for, 0 when absent) to the tail, and to the rings if asked;
+    // returns how many.
+    int64_t Replay(const std::map<int64_t, int64_t>& watermarks, bool to_ring) {
+        int64_t rows = 0;
+        for (size_t p = 0; p < partitions.size(); p++) {
+            std::map<int64_t, int64_t>::const_iterator wm = watermarks.find(partitions[p]);
+            sqlite3_stmt* stmt;
+            std::string sql = "SELECT time, temp, repeats, sensor FROM " + PartitionName("log", partitions[p]) +
+                              " WHERE rowid > ? ORDER BY rowid;";
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+                sqlite3_bind_int64(stmt, 1, wm == watermarks.end() ? 0 : wm->second);
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    Sample s = { sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2),
+                                 sqlite3_column_int(stmt, 3) };
+                    AddTail(s);
+                    if (to_ring) recent[s.sensor].Push(s);
+                    rows++;
+                }
+            }
+            sqlite3_finalize(stmt);
+        }
+        return rows;
+    }
+
+    // Snapshot file: "TSNP", format, payload size and CRC32 (each 4 bytes,
+    // little endian), then a varint payload: generation, each sensor's ring
+    // samples oldest first, tail buckets with their sensor and sketch, and
+    // each partition's max rowid. Format 1 had a single ring and no sensors.
+    static const uint32_t SNAPSHOT_FORMAT = 2;
+
+    void SaveSnapshot() {
+        std::string payload;
+        PutVarint(payload, generation);
+
+        PutVarint(payload, recent.size());
+        for (std::map<int, RecentRing<64>>::const_iterator it = recent.begin(); it != recent.end(); ++it) {
+            std::vector<Sample> ring = it->second.Latest(64);
+            PutSignedVarint(payload, it->first);
+            PutVarint(payload, ring.size());
+            for (size_t i = ring.size(); i > 0; i--) {
+                PutSignedVarint(payload, ring[i - 1].time);
+                PutSignedVarint(payload, ring[i - 1].value);
+            }
+        }
+
+        PutVarint(payload, tail.size());
+        for (std::map<std::pair<int, int64_t>, TailBucket>::const_iterator it = tail.begin(); it != tail.end(); ++it) {
+            std::string sketch = it->second.hist.Encode();
+            PutSignedVarint(payload, it->first.first);
+            PutSignedVarint(payload, it->first.second);
+            PutVarint(payload, it->second.summary.n);
+            PutSignedVarint(payload, it->second.summary.sum);
+            PutSignedVarint(payload, it->second.summary.min);
+            PutSignedVarint(payload, it->second.summary.max);
+            PutVarint(payload, sketch.size());
+            payload += sketch;
+        }
+
+        PutVarint(payload, partitions.size());
+        for (size_t p = 0; p < partitions.size(); p++) {
+            PutSignedVarint(payload, partitions[p]);
+            PutVarint(payload, QueryInt(("SELECT MAX(rowid) FROM " + PartitionName("log", partitions[p]) + ";").c_str()));
+        }
+
+        uint8_t header[16] = { 'T', 'S', 'N', 'P' };
+        uint32_t fields[3] = { SNAPSHOT_FORMAT, (uint32_t)payload.size(), Crc32(payload.data(), payload.size()) };
+        for (int f = 0; f < 3; f++) {
+            for (int b = 0; b < 4; b++) header[4 + f * 4 + b] = (uint8_t)(fields[f] >> (8 * b));
+        }
+
+        std::string tmp = snapshot_path + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "wb");
+        if (!out) return;
+        bool ok = fwrite(header, 1, sizeof(header), out) == sizeof(header) &&
+                  fwrite(payload.data(), 1, payload.size(), out) == payload.size();
+        ok = (fclose(out) == 0) && ok;
+        remove(snapshot_path.c_str());
+        if (!ok || rename(tmp.c_str(), snapshot_path.c_str()) != 0) {
+            std::cout << "Snapshot Error: can't write " << snapshot_path << std::endl;
+            return;
+        }
+        snapshot_generation = generation;
+        snapshot_time = g_clock.Now();
+    }
+
+    // Called from the main loop; checkpoints once a minute or right after
+    // rows left the log partitions.
+    void SaveSnapshotIfDue() {
+        if (generation != snapshot_generation || g_clock.Now() - snapshot_time >= MS_PER_MINUTE) SaveSnapshot();
+    }
+
+    // Restores the rings and tail from the snapshot and replays the rows
+    // written after it. Returns the number replayed, or -1 when there is no
+    // usable snapshot and the caller must rebuild from scratch.
+    int64_t LoadSnapshot() {
+        FILE* in = fopen(snapshot_path.c_str(), "rb");
+        if (!in) return -1;
+        std::string data;
+        char chunk[65536];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0) data.append(chunk, got);
+        fclose(in);
+
+        const uint8_t* h = (const uint8_t*)data.data();
+        if (data.size() < 16 || memcmp(h, "TSNP", 4) != 0) return -1;
+        uint32_t fields[3];
+        for (int f = 0; f < 3; f++) {
+            fields[f] = 0;
+            for (int b = 0; b < 4; b++) fields[f] |= (uint32_t)h[4 + f * 4 + b] << (8 * b);
+        }
+        if (fields[0] != SNAPSHOT_FORMAT) {
+            std::cout << "Snapshot is from an older version, rebuilding" << std::endl;
+            return -1;
+        }
+        if (fields[1] != data.size() - 16 || fields[2] != Crc32(h + 16, fields[1])) {
+            std::cout << "Snapshot is damaged, rebuilding" << std::endl;
+            return -1;
+        }
+
+        const uint8_t* p = h + 16;
+        const uint8_t* end = p + fields[1];
+        uint64_t gen, count;
+        if (!GetVarint(p, end, gen) || (int64_t)gen != generation) {
+            std::cout << "Snapshot is out of date, rebuilding" << std::endl;
+            return -1;
+        }
+
+        std::vector<Sample> ring;
+        std::map<std::pair<int, int64_t>, TailBucket> buckets;
+        std::map<int64_t, int64_t> watermarks;
+        uint64_t rings = 0;
+        bool ok = GetVarint(p, end, rings);
+        for (uint64_t r = 0; ok && r < rings; r++) {
+            int64_t sensor = 0;
+            ok = GetSignedVarint(p, end, sensor) && GetVarint(p, end, count);
+            for (uint64_t i = 0; ok && i < count; i++) {
+                Sample s = { 0, 0, 0, (int)sensor };
+                ok = GetSignedVarint(p, end, s.time) && GetSignedVarint(p, end, s.value);
+                ring.push_back(s);
+            }
+        }
+        ok = ok && GetVarint(p, end, count);
+        for (uint64_t i = 0; ok && i < count; i++) {
+            int64_t sensor = 0, minute = 0;
+            uint64_t n = 0, size = 0;
+            TailBucket b;
+            ok = GetSignedVarint(p, end, sensor) && GetSignedVarint(p, end, minute) && GetVarint(p, end, n) &&
+                 GetSignedVarint(p, end, b.summary.sum) && GetSignedVarint(p, end, b.summary.min) &&
+                 GetSignedVarint(p, end, b.summary.max) && GetVarint(p, end, size) &&
+                 size <= (uint64_t)(end - p) && b.hist.Decode(p, size);
+            b.summary.n = (int64_t)n;
+            if (ok) p += size;
+            buckets[std::make_pair((int)sensor, minute)] = b;
+        }
+        ok = ok && GetVarint(p, end, count);
+        for (uint64_t i = 0; ok && i < count; i++) {
+            int64_t day = 0;
+            uint64_t rowid = 0;
+            ok = GetSignedVarint(p, end, day) && GetVarint(p, end, rowid);
+            watermarks[day] = (int64_t)rowid;
+        }
+        if (!ok) {
+            std::cout << "Snapshot is damaged, rebuilding" << std::endl;
+            return -1;
+        }
+
+        tail.swap(buckets);
+        for (size_t i = 0; i < ring.size(); i++) recent[ring[i].sensor].Push(ring[i]);
+        snapshot_generation = generation;
+        snapshot_time = g_clock.Now();
+        return Replay(watermarks, true);
+    }
+
+    // Schema versions (PRAGMA user_version):
+    //   0, 1  log.time in seconds, log.temp REAL degrees, block times in seconds
+    //   2     log.time and block times in epoch ms, log.temp in 0.01 degrees
+    //   3     log and blocks split into per-day log_YYYYMMDD and blocks_YYYYMMDD
+    //   4     rollups carry a histogram sketch; rebuilt from the blocks still
+    //         kept, older rollups keep a NULL one
+    //   5     meta table with the seal generation checked by snapshots
+    //   6     rollup_day
+    //   7     archives table of exported Parquet files
+    //   8     senders table with the delivery state of reliable senders
+    //   9     log partitions carry a repeats column (see Sample::repeats)
+    //   10    log partitions, blocks and rollups carry a sensor id (see
+    //         Sample::sensor); blocks and rollups are keyed by it
+    bool Migrate() {
+        if (HasTable("log")) {
+            if (QueryInt("PRAGMA user_version;") < 2 && !MigrateToMilliseconds()) return false;
+            if (!MigrateToPartitions()) return false;
+        }
+        if (HasTable("rollup_hour") &&
+            QueryInt("SELECT COUNT(*) FROM pragma_table_info('rollup_hour') WHERE name = 'hist';") == 0) {
+            std::cout << "Adding histogram sketches to rollups..." << std::endl;
+            if (!Exec("ALTER TABLE rollup_minute ADD COLUMN hist BLOB;"
+                      "ALTER TABLE rollup_hour ADD COLUMN hist BLOB;")) return false;
+        }
+        if (QueryInt("PRAGMA user_version;") < 9 && !MigrateToRepeats()) return false;
+        if (QueryInt("PRAGMA user_version;") < 10 && !MigrateToSensors()) return false;
+        return true;
+    }
+
+    // Log partitions take the column in place, like repeats. Blocks and
+    // rollups get it in their primary key, which means copying them into new
+    // tables. Everything stored so far becomes sensor 0.
+    bool MigrateToSensors() {
+        const char* rollups[] = { "rollup_minute", "rollup_hour", "rollup_day" };
+        LoadPartitions();
+        bool any = !partitions.empty();
+        for (int i = 0; i < 3; i++) any = any || HasTable(rollups[i]);
+        if (!any) return true;
+        std::cout << "Adding sensor ids to partitions and rollups..." << std::endl;
+        if (!Exec("BEGIN;")) return false;
+        bool ok = true;
+        for (size_t i = 0; ok && i < partitions.size(); i++) {
+            std::string log = PartitionName("log", partitions[i]), blocks = PartitionName("blocks", partitions[i]);
+            if (!HasColumn(log, "sensor")) {
+                ok = Exec(("ALTER TABLE " + log + " ADD COLUMN sensor INTEGER NOT NULL DEFAULT 0;").c_str());
+            }
+            if (ok && !HasColumn(blocks, "sensor")) {
+                ok = Exec(("CREATE TABLE blocks_v10 " + std::string(BLOCK_COLUMNS) + ";"
+                           "INSERT INTO blocks_v10 (hour, n, data) SELECT hour, n, data FROM " + blocks + ";"
+                           "DROP TABLE " + blocks + "; ALTER TABLE blocks_v10 RENAME TO " + blocks + ";").c_str());
+            }
+        }
+        for (int i = 0; ok && i < 3; i++) {
+            std::string table = rollups[i];
+            if (!HasTable(rollups[i]) || HasColumn(table, "sensor")) continue;
+            ok = Exec(("CREATE TABLE rollup_v10 " + std::string(ROLLUP_COLUMNS) + ";"
+                       "INSERT INTO rollup_v10 (bucket, n, sum, min, max, hist) SELECT bucket, n, sum, min, max, hist FROM " + table + ";"
+                       "DROP TABLE " + table + "; ALTER TABLE rollup_v10 RENAME TO " + table + ";").c_str());
+        }
+        Exec(ok ? "COMMIT;" : "ROLLBACK;");
+        return ok;
+    }
+
+    // Adding a column with a default only rewrites the schema, not the rows.
+    bool MigrateToRepeats() {
+        LoadPartitions();
+        if (partitions.empty()) return true;
+        std::cout << "Adding repeat counts to log partitions..." << std::endl;
+        if (!Exec("BEGIN;")) return false;
+        bool ok = true;
+        for (size_t i = 0; ok && i < partitions.size(); i++) {
+            std::string log = PartitionName("log", partitions[i]);
+            if (QueryInt(("SELECT COUNT(*) FROM pragma_table_info('" + log + "') WHERE name = 'repeats';").c_str()) == 0) {
+                ok = Exec(("ALTER TABLE " + log + " ADD COLUMN repeats INTEGER NOT NULL DEFAULT 0;").c_str());
+            }
+        }
+        Exec(ok ? "COMMIT;" : "ROLLBACK;");
+        return ok;
+    }
+
+    bool MigrateToPartitions() {
+        std::cout << "Migrating data.db to daily partitions..." << std::endl;
+        if (!Exec("BEGIN;")) return false;
+        bool ok = true;
+        if (!HasTable("blocks")) ok = Exec("CREATE TABLE blocks (hour INTEGER PRIMARY KEY, n INTEGER, data BLOB);");
+
+        std::vector<int64_t> days;
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT time / 86400000 FROM log UNION SELECT hour / 24 FROM blocks;";
+        if (ok && sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) days.push_back(sqlite3_column_int64(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+
+        for (size_t i = 0; ok && i < days.size(); i++) {
+            char range[128];
+            ok = EnsurePartition(days[i]);
+            sprintf(range, " WHERE time >= %lld AND time < %lld;",
+                    (long long)(days[i] * MS_PER_DAY), (long long)((days[i] + 1) * MS_PER_DAY));
+            if (ok) ok = Exec(("INSERT INTO " + PartitionName("log", days[i]) + " (time, temp) SELECT time, temp FROM log" + range).c_str());
+            sprintf(range, " WHERE hour >= %lld AND hour < %lld;",
+                    (long long)(days[i] * 24), (long long)((days[i] + 1) * 24));
+            if (ok) ok = Exec(("INSERT INTO " + PartitionName("blocks", days[i]) + " (hour, n, data) SELECT hour, n, data FROM blocks" + range).c_str());
+        }
+
+        if (ok) ok = Exec("DROP TABLE log; DROP TABLE blocks; PRAGMA user_version = 3;");
+        Exec(ok ? "COMMIT;" : "ROLLBACK;");
+        return ok;
+    }
+
+    bool MigrateToMilliseconds() {
+        std::cout << "Migrating data.db to millisecond timestamps..." << std::endl;
+        if (!Exec("BEGIN;")) return false;
+        bool ok = Exec("CREATE TABLE log_v2 (time INTEGER, temp INTEGER);"
+                       "INSERT INTO log_v2 SELECT time * 1000, CAST(ROUND(temp * 100) AS INTEGER) FROM log;"
+                       "DROP TABLE log;"
+                       "ALTER TABLE log_v2 RENAME TO log;");
+
+        sqlite3_stmt* stmt;
+        std::vector<std::pair<int64_t, std::string> > blocks;
+        if (ok && HasTable("blocks") &&
+            sqlite3_prepare_v2(db, "SELECT hour, data FROM blocks;", -1, &stmt, 0) == SQLITE_OK) {
+            std::vector<Sample> samples;
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                samples.clear();
+                DecodeBlock(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), samples);
+                for (size_t i = 0; i < samples.size(); i++) samples[i].time *= 1000;
+                blocks.push_back(std::make_pair(sqlite3_column_int64(stmt, 0), EncodeBlock(samples)));
+            }
+            sqlite3_finalize(stmt);
+        }
+        for (size_t i = 0; ok && i < blocks.size(); i++) {
+            ok = false;
+            if (sqlite3_prepare_v2(db, "UPDATE blocks SET data = ? WHERE hour = ?;", -1, &stmt, 0) == SQLITE_OK) {
+                sqlite3_bind_blob(stmt, 1, blocks[i].second.data(), (int)blocks[i].second.size(), SQLITE_TRANSIENT);
+                sqlite3_bind_int64(stmt, 2, blocks[i].first);
+                ok = (sqlite3_step(stmt) == SQLITE_DONE);
+            }
+            sqlite3_finalize(stmt);
+        }
+
+        if (ok) ok = Exec("PRAGMA user_version = 2;");
+        Exec(ok ? "COMMIT;" : "ROLLBACK;");
+        return ok;
+    }
+
+    int64_t QueryInt(const char* sql) {
+        sqlite3_stmt* stmt;
+        int64_t result = 0;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) result = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return result;
+    }
+
+    // Blocks sealed before rollups (or their sketches) existed get them built once.
+    bool BackfillRollups() {
+        if (!Exec("BEGIN;")) return false;
+        bool ok = true;
+        for (size_t p = 0; ok && p < partitions.size(); p++) {
+            sqlite3_stmt* stmt;
+            std::string sql = "SELECT hour, sensor, data FROM " + PartitionName("blocks", partitions[p]) +
+                              " b WHERE NOT EXISTS (SELECT 1 FROM rollup_hour r WHERE r.bucket = b.hour AND "
+                              "r.sensor = b.sensor AND r.hist IS NOT NULL);";
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+                std::vector<Sample> samples;
+                while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+                    samples.clear();
+                    DecodeBlock(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2), samples);
+                    ok = WriteRollups(sqlite3_column_int(stmt, 1), sqlite3_column_int64(stmt, 0), samples, false);
+                }
+            }
+            sqlite3_finalize(stmt);
+        }
+
+        sqlite3_stmt* stmt;
+        std::vector<std::pair<int, int64_t> > days; // sensor, day
+        if (ok && sqlite3_prepare_v2(db, "SELECT DISTINCT h.sensor, h.bucket / 24 FROM rollup_hour h WHERE NOT EXISTS "
+                                         "(SELECT 1 FROM rollup_day d WHERE d.bucket = h.bucket / 24 AND d.sensor = h.sensor);",
+                                     -1, &stmt, 0) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                days.push_back(std::make_pair(sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 1)));
+            }
+        }
+        sqlite3_finalize(stmt);
+        for (size_t i = 0; ok && i < days.size(); i++) ok = WriteDayRollup(days[i].first, days[i].second);
+        return Exec(ok ? "COMMIT;" : "ROLLBACK;") && ok;
+    }
+
+    // Points insert_stmt at the partition of `day`.
+    bool PrepareInsert(int64_t day) {
+        sqlite3_finalize(insert_stmt);
+        insert_stmt = nullptr;
+        insert_day = INT64_MIN;
+        if (!EnsurePartition(day)) return false;
+        std::string sql = "INSERT INTO " + PartitionName("log", day) + " VALUES (?, ?, ?, ?);";
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &insert_stmt, 0) != SQLITE_OK) {
+            std::cout << "Insert Error: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        insert_day = day;
+        return true;
+    }
+
+    // Writes one row into the log partition of its day.
+    bool Append(const Sample& s) {
+        if (s.time / MS_PER_DAY != insert_day && !PrepareInsert(s.time / MS_PER_DAY)) return false;
+        sqlite3_bind_int64(insert_stmt, 1, s.time);
+        sqlite3_bind_int64(insert_stmt, 2, s.value);
+        sqlite3_bind_int64(insert_stmt, 3, s.repeats);
+        sqlite3_bind_int(insert_stmt, 4, s.sensor);
+        bool ok = (sqlite3_step(insert_stmt) == SQLITE_DONE);
+        if (!ok) std::cout << "Insert Error: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_reset(insert_stmt);
+        return ok;
+    }
+
+    bool Insert(float temp, int64_t repeats = 0, int sensor = 0) {
+        Sample s = { g_clock.Now(), ToFixed(temp), repeats, sensor };
+        if (!Append(s)) return false;
+        committed = std::chrono::steady_clock::now();
+        AddTail(s);
+        recent[sensor].Push(s);
+        published = std::chrono::steady_clock::now();
+        std::cout << "Saved: " << temp << std::endl;
+        return true;
+    }
+
+    // Several readings that arrived together, stored in one transaction so
+    // a batched datagram costs one commit instead of one per reading. A
+    // reliable sender's delivery state is saved in the same transaction, so
+    // what it says is stored always is. Samples may be older than the newest
+    // one of their sensor (a sender's replay); those skip its ring of latest
+    // readings.
+    bool InsertBatch(const std::vector<Sample>& samples, uint32_t sender = 0, const Delivery* delivery = nullptr) {
+        if (!Exec("BEGIN;")) return false;
+        bool ok = true;
+        for (size_t i = 0; ok && i < samples.size(); i++) ok = Append(samples[i]);
+        if (ok && delivery) ok = SaveDelivery(sender, *delivery);
+        if (!ok) {
+            Exec("ROLLBACK;");
+            return false;
+        }
+        if (!Exec("COMMIT;")) return false;
+        committed = published = std::chrono::steady_clock::now();
+        if (samples.empty()) return true;
+
+        std::map<int, int64_t> latest; // newest time in the ring of each sensor seen
+        for (size_t i = 0; i < samples.size(); i++) {
+            const Sample& s = samples[i];
+            AddTail(s);
+            std::map<int, int64_t>::iterator it = latest.find(s.sensor);
+            if (it == latest.end()) {
+                std::vector<Sample> newest = Recent(s.sensor, 1);
+                it = latest.insert(std::make_pair(s.sensor, newest.empty() ? INT64_MIN : newest[0].time)).first;
+            }
+            if (s.time >= it->second) {
+                recent[s.sensor].Push(s);
+                it->second = s.time;
+            }
+        }
+        published = std::chrono::steady_clock::now();
+        std::cout << "Saved " << samples.size() << " readings" << std::endl;
+        return true;
+    }
+
+    Delivery LoadDelivery(uint32_t sender) {
+        Delivery d;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "SELECT acked, window FROM senders WHERE id = ?;", -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, sender);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                d.acked = (uint64_t)sqlite3_column_int64(stmt, 0);
+                if (sqlite3_column_bytes(stmt, 1) == (int)sizeof(d.seen)) {
+                    memcpy(d.seen, sqlite3_column_blob(stmt, 1), sizeof(d.seen));
+                }
+            }
+        }
+        sqlite3_finalize(stmt);
+        return d;
+    }
+
+    bool SaveDelivery(uint32_t sender, const Delivery& d) {
+        sqlite3_stmt* stmt;
+        bool ok = false;
+        if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO senders VALUES (?, ?, ?);", -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, sender);
+            sqlite3_bind_int64(stmt, 2, (int64_t)d.acked);
+            sqlite3_bind_blob(stmt, 3, d.seen, sizeof(d.seen), SQLITE_STATIC);
+            ok = (sqlite3_step(stmt) == SQLITE_DONE);
+        }
+        if (!ok) std::cout << "Insert Error: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_finalize(stmt);
+        return ok;
+    }
+
+    // First day whose partition still holds unexpired raw data.
+    int64_t FirstLiveDay() {
+        if (retention.raw_days <= 0) return INT64_MIN;
+        return (g_clock.Now() - retention.raw_days * MS_PER_DAY) / MS_PER_DAY;
+    }
+
+    // Moves every finished hour still sitting in a log partition into the
+    // blocks of its sensors, in one ordered pass per partition. Rows that arrive late for an
+    // already sealed hour are merged into it. Partitions that are about to be
+    // dropped by retention are sealed by DropPartition instead.
+    void SealColdHours() {
+        int64_t cutoff = g_clock.Now() / MS_PER_HOUR * MS_PER_HOUR;
+        int64_t live = FirstLiveDay();
+        if (!Exec("BEGIN;")) return;
+
+        bool ok = true;
+        std::vector<int64_t> sealed;
+        for (size_t p = 0; ok && p < partitions.size(); p++) {
+            int64_t day = partitions[p];
+            if (day < live || day * MS_PER_DAY >= cutoff) continue;
+            ok = SealPartition(day, cutoff, sealed);
+        }
+
+        if (ok && !sealed.empty()) ok = Exec("UPDATE meta SET value = value + 1 WHERE key = 'generation';");
+        if (!ok) {
+            std::cout << "Seal Error: " << sqlite3_errmsg(db) << std::endl;
+            Exec("ROLLBACK;");
+            return;
+        }
+        if (!Exec("COMMIT;")) return;
+        if (sealed.empty()) return;
+        generation++;
+        for (size_t i = 0; i < sealed.size(); i++) {
+            DropTail(sealed[i] * MS_PER_HOUR / MS_PER_MINUTE, (sealed[i] + 1) * MS_PER_HOUR / MS_PER_MINUTE);
+        }
+    }
+
+    // Seals the rows of the partition of `day` older than `cutoff`, adding the
+    // hours it touched to `sealed`. Runs inside the caller's transaction.
+    bool SealPartition(int64_t day, int64_t cutoff, std::vector<int64_t>& sealed) {
+        bool ok = true;
+        sqlite3_stmt* stmt;
+        std::string log = PartitionName("log", day);
+        std::string sql = "SELECT time, temp, repeats, sensor FROM " + log + " WHERE time < ? ORDER BY sensor, time;";
+        std::vector<Sample> rows;
+        int64_t hour = 0;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, cutoff);
+            while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+                Sample s = { sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2),
+                             sqlite3_column_int(stmt, 3) };
+                if (!rows.empty() && (s.time / MS_PER_HOUR != hour || s.sensor != rows[0].sensor)) {
+                    ok = SealHour(rows[0].sensor, hour, rows);
+                    sealed.push_back(hour);
+                    rows.clear();
+                }
+                hour = s.time / MS_PER_HOUR;
+                rows.push_back(s);
+            }
+        }
+        sqlite3_finalize(stmt);
+        if (ok && !rows.empty()) {
+            ok = SealHour(rows[0].sensor, hour, rows);
+            sealed.push_back(hour);
+        }
+
+        sql = "DELETE FROM " + log + " WHERE time < ?;";
+        if (ok && sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, cutoff);
+            ok = (sqlite3_step(stmt) == SQLITE_DONE);
+        }
+        sqlite3_finalize(stmt);
+        return ok;
+    }
+
+    // Merges `rows` (sorted by time) into the block of `sensor` for `hour`.
+    bool SealHour(int sensor, int64_t hour, const std::vector<Sample>& rows) {
+        std::vector<Sample> samples;
+        size_t old_size = 0;
+        std::string blocks = PartitionName("blocks", hour * MS_PER_HOUR / MS_PER_DAY);
+
+        sqlite3_stmt* stmt;
+        std::string sql = "SELECT data FROM " + blocks + " WHERE hour = ? AND sensor = ?;";
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, hour);
+            sqlite3_bind_int(stmt, 2, sensor);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                old_size = sqlite3_column_bytes(stmt, 0);
+                DecodeBlock(sqlite3_column_blob(stmt, 0), old_size, samples);
+            }
+        }
+        sqlite3_finalize(stmt);
+
+        if (samples.empty()) {
+            samples = rows;
+        } else {
+            std::vector<Sample> merged;
+            merged.reserve(samples.size() + rows.size());
+            std::merge(samples.begin(), samples.end(), rows.begin(), rows.end(), std::back_inserter(merged),
+                       [](const Sample& a, const Sample& b) { return a.time < b.time; });
+            samples.swap(merged);
+        }
+        std::string block = EncodeBlock(samples);
+
+        bool ok = false;
+        sql = "INSERT OR REPLACE INTO " + blocks + " VALUES (?, ?, ?, ?);";
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, hour);
+            sqlite3_bind_int(stmt, 2, sensor);
+            sqlite3_bind_int64(stmt, 3, (sqlite3_int64)samples.size());
+            sqlite3_bind_blob(stmt, 4, block.data(), (int)block.size(), SQLITE_TRANSIENT);
+            ok = (sqlite3_step(stmt) == SQLITE_DONE);
+        }
+        sqlite3_finalize(stmt);
+
+        if (ok) ok = WriteRollups(sensor, hour, rows, true);
+        if (ok && verbose) {
+            std::cout << "Sealed hour " << hour << " of sensor " << sensor << ": " << rows.size() << " rows, "
+                      << old_size << " -> " << block.size() << " bytes" << std::endl;
+        }
+        return ok;
+    }
+
+    // Writes the minute and hour rollups of `sensor` for `hour` from
+    // `samples` (sorted by time): built from them alone, or with `add`, merged
+    // into the rollups already there, which outlive the block they came from.
+    bool WriteRollups(int sensor, int64_t hour, const std::vector<Sample>& samples, bool add) {
+        Summary total;
+        Histogram total_hist;
+        Summary minute;
+        Histogram minute_hist;
+        bool ok = true;
+        for (size_t i = 0; ok && i < samples.size(); i++) {
+            int64_t value = samples[i].value, count = samples[i].Count();
+            minute.Add(value, count);
+            minute_hist.Add(value, (uint32_t)count);
+            total.Add(value, count);
+            total_hist.Add(value, (uint32_t)count);
+            int64_t bucket = samples[i].time / MS_PER_MINUTE;
+            if (i + 1 == samples.size() || samples[i + 1].time / MS_PER_MINUTE != bucket) {
+                if (add) SummarizeRollups("rollup_minute", sensor, bucket, bucket + 1, minute, &minute_hist);
+                ok = WriteRollup("rollup_minute", sensor, bucket, minute, minute_hist);
+                minute = Summary();
+                minute_hist = Histogram();
+            }
+        }
+        if (ok && add) SummarizeRollups("rollup_hour", sensor, hour, hour + 1, total, &total_hist);
+        return ok && WriteRollup("rollup_hour", sensor, hour, total, total_hist) &&
+               WriteDayRollup(sensor, hour * MS_PER_HOUR / MS_PER_DAY);
+    }
+
+    // Rebuilds the day rollup of `sensor` for `day` from its hour rollups.
+    bool WriteDayRollup(int sensor, int64_t day) {
+        Summary total;
+        Histogram total_hist;
+        SummarizeRollups("rollup_hour", sensor, day * 24, (day + 1) * 24, total, &total_hist);
+        return WriteRollup("rollup_day", sensor, day, total, total_hist);
+    }
+
+    bool WriteRollup(const char* table, int sensor, int64_t bucket, const Summary& s, const Histogram& hist) {
+        if (s.n == 0) return true;
+        std::string sql = std::string("INSERT OR REPLACE INTO ") + table + " VALUES (?, ?, ?, ?, ?, ?, ?);";
+        std::string sketch = hist.Encode();
+        sqlite3_stmt* stmt;
+        bool ok = false;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, bucket);
+            sqlite3_bind_int(stmt, 2, sensor);
+            sqlite3_bind_int64(stmt, 3, s.n);
+            sqlite3_bind_int64(stmt, 4, s.sum);
+            sqlite3_bind_int64(stmt, 5, s.min);
+            sqlite3_bind_int64(stmt, 6, s.max);
+            sqlite3_bind_blob(stmt, 7, sketch.data(), (int)sketch.size(), SQLITE_TRANSIENT);
+            ok = (sqlite3_step(stmt) == SQLITE_DONE);
+        }
+        sqlite3_finalize(stmt);
+        return ok;
+    }
+
+    // Runs one bounded delete; returns the number of rows it removed.
+    int64_t DeleteBatch(const char* sql, int64_t cutoff) {
+        sqlite3_stmt* stmt;
+        int64_t removed = 0;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, cutoff);
+            if (sqlite3_step(stmt) == SQLITE_DONE) removed = sqlite3_changes(db);
+        }
+        sqlite3_finalize(stmt);
+        return removed;
+    }
+
+    // Drops expired raw partitions one day at a time and deletes expired
+    // rollups in small batches, so a large backlog never holds the write lock
+    // for long, then gives the pages back with
+    // incremental vacuum. Spends at most ~50 ms per call and returns true while
+    // work is left; the totals are reported once a pass has caught up.
+    bool EnforceRetention() {
+        int64_t now = g_clock.Now();
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+        int64_t page_size = QueryInt("PRAGMA page_size;");
+        if (reclaim_start_bytes < 0) reclaim_start_bytes = QueryInt("PRAGMA page_count;") * page_size;
+
+        bool more = true;
+        while (more && std::chrono::steady_clock::now() < deadline) {
+            more = false;
+            if (!partitions.empty() && partitions[0] < FirstLiveDay()) {
+                reclaim_raw += DropPartition(partitions[0]);
+                more = true;
+            }
+            if (retention.minute_days > 0) {
+                int64_t n = DeleteBatch("DELETE FROM rollup_minute WHERE rowid IN "
+                                        "(SELECT rowid FROM rollup_minute WHERE bucket < ? LIMIT 1000);",
+                                        (now - retention.minute_days * MS_PER_DAY) / MS_PER_MINUTE);
+                reclaim_minute += n;
+                more = more || n > 0;
+            }
+            if (retention.hour_days > 0) {
+                int64_t n = DeleteBatch("DELETE FROM rollup_hour WHERE rowid IN "
+                                        "(SELECT rowid FROM rollup_hour WHERE bucket < ? LIMIT 1000);",
+                                        (now - retention.hour_days * MS_PER_DAY) / MS_PER_HOUR);
+                reclaim_hour += n;
+                more = more || n > 0;
+            }
+        }
+        if (more) return true;
+
+        while (QueryInt("PRAGMA freelist_count;") > 0) {
+            if (std::chrono::steady_clock::now() >= deadline) return true;
+            Exec("PRAGMA incremental_vacuum(256);");
+        }
+
+        if (reclaim_raw + reclaim_minute + reclaim_hour > 0) {
+            int64_t reclaimed = reclaim_start_bytes - QueryInt("PRAGMA page_count;") * page_size;
+            std::cout << "Retention: removed " << reclaim_raw << " raw rows, " << reclaim_minute
+                      << " minute and " << reclaim_hour << " hour rollups, reclaimed "
+                      << reclaimed << " bytes" << std::endl;
+        }
+        reclaim_raw = reclaim_minute = reclaim_hour = 0;
+        reclaim_start_bytes = -1;
+        return false;
+    }
+
+    // The Scan* family hands over the samples of `sensor` (or ALL_SENSORS)
+    // in [from, to).
+
+    // Decodes every block overlapping the range.
+    void ScanBlocks(int sensor, int64_t from, int64_t to, const std::function<void(const Sample&)>& fn) {
+        std::vector<int64_t> days = PartitionsIn(from, to);
+        std::vector<Sample> samples;
+        for (size_t p = 0; p < days.size(); p++) {
+            sqlite3_stmt* stmt;
+            std::string sql = "SELECT sensor, data FROM " + PartitionName("blocks", days[p]) +
+                              " WHERE hour >= ?1 AND hour <= ?2 AND (?3 < 0 OR sensor = ?3) ORDER BY hour;";
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+                sqlite3_bind_int64(stmt, 1, from / MS_PER_HOUR);
+                sqlite3_bind_int64(stmt, 2, (to - 1) / MS_PER_HOUR);
+                sqlite3_bind_int(stmt, 3, sensor);
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    samples.clear();
+                    DecodeBlock(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), samples);
+                    for (size_t i = 0; i < samples.size(); i++) {
+                        samples[i].sensor = sqlite3_column_int(stmt, 0);
+                        if (samples[i].time >= from && samples[i].time < to) fn(samples[i]);
+                    }
+                }
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    // Unsealed rows, in no particular order.
+    void ScanLog(int sensor, int64_t from, int64_t to, const std::function<void(const Sample&)>& fn) {
+        std::vector<int64_t> days = PartitionsIn(from, to);
+        for (size_t p = 0; p < days.size(); p++) {
+            sqlite3_stmt* stmt;
+            std::string sql = "SELECT time, temp, repeats, sensor FROM " + PartitionName("log", days[p]) +
+                              " WHERE time >= ?1 AND time < ?2 AND (?3 < 0 OR sensor = ?3);";
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+                sqlite3_bind_int64(stmt, 1, from);
+                sqlite3_bind_int64(stmt, 2, to);
+                sqlite3_bind_int(stmt, 3, sensor);
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    Sample s = { sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2),
+                                 sqlite3_column_int(stmt, 3) };
+                    fn(s);
+                }
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    // Archived samples, reading only row groups whose time statistics overlap
+    // the range. Where archives overlap, the earlier one wins.
+    void ScanArchives(int sensor, int64_t from, int64_t to, const std::function<void(const Sample&)>& fn) {
+        int64_t covered = from;
+        std::vector<int64_t> times;
+        std::vector<double> temps;
+        std::vector<int64_t> repeats;
+        std::vector<int64_t> sensors;
+        for (size_t i = 0; i < archives.size() && covered < to; i++) {
+            int64_t a = std::max(covered, archives[i].from), b = std::min(to, archives[i].to);
+            if (a >= b) continue;
+            covered = std::max(covered, b);
+            parquet::Reader reader;
+            if (!reader.Open(archives[i].file)) {
+                std::cout << "Archive Error: can't read " << archives[i].file << std::endl;
+                continue;
+            }
+            for (size_t g = 0; g < reader.groups.size(); g++) {
+                if (reader.groups[g].max_time < a || reader.groups[g].min_time >= b) continue;
+                if (!reader.ReadRowGroup(g, times, temps, repeats, sensors)) {
+                    std::cout << "Archive Error: bad row group in " << archives[i].file << std::endl;
+                    break;
+                }
+                for (size_t k = 0; k < times.size(); k++) {
+                    if (times[k] < a || times[k] >= b || (sensor != ALL_SENSORS && sensors[k] != sensor)) continue;
+                    Sample s = { times[k], ToFixed(temps[k]), repeats[k], (int)sensors[k] };
+                    fn(s);
+                }
+            }
+        }
+    }
+
+    // Whether the archives together hold all of [from, to).
+    bool ArchivesCover(int64_t from, int64_t to) {
+        for (size_t i = 0; i < archives.size() && from < to; i++) {
+            if (archives[i].from <= from) from = std::max(from, archives[i].to);
+        }
+        return from >= to;
+    }
+
+    // Newest `count` samples of `sensor`, newest first: walks partitions
+    // backwards, each one's unsealed rows first and then its blocks.
+    std::vector<Sample> GetLatest(int sensor, int count) {
+        std::vector<Sample> result;
+        std::vector<Sample> samples;
+        for (size_t p = partitions.size(); p > 0 && (int)result.size() < count; p--) {
+            sqlite3_stmt* stmt;
+            std::string sql = "SELECT time, temp, repeats FROM " + PartitionName("log", partitions[p - 1]) +
+                              " WHERE sensor = ? ORDER BY time DESC, rowid DESC LIMIT ?;";
+            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+                sqlite3_bind_int(stmt, 1, sensor);
+                sqlite3_bind_int(stmt, 2, count - (int)result.size());
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    Sample s = { sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2), sensor };
+                    result.push_back(s);
+                }
+            }
+            sqlite3_finalize(stmt);
+
+            sql = "SELECT data FROM " + PartitionName("blocks", partitions[p - 1]) + " WHERE sensor = ? ORDER BY hour DESC;";
+            if ((int)result.size() < count && sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+                sqlite3_bind_int(stmt, 1, sensor);
+                while ((int)result.size() < count && sqlite3_step(stmt) == SQLITE_ROW) {
+                    samples.clear();
+                    DecodeBlock(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0), samples);
+                    for (size_t i = samples.size(); i > 0 && (int)result.size() < count; i--) {
+                        result.push_back(samples[i - 1]);
+                        result.back().sensor = sensor;
+                    }
+                }
+                sqlite3_finalize(stmt);
+            }
+        }
+        return result;
+    }
+
+    std::string GetLastRecord(int sensor) {
+        std::string result = "No data yet";
+        std::vector<Sample> last = Recent(sensor, 1);
+        if (!last.empty()) {
+            time_t t = (time_t)(last[0].time / 1000);
+
+            char buf[100];
+            struct tm* tm_info = localtime(&t);
+            strftime(buf, sizeof(buf), "%H:%M:%S", tm_info);
+
+            std::stringstream ss;
+            ss << buf << " | " << FromFixed(last[0].value) << " °C";
+            result = ss.str();
+        }
+        return result;
+    }
+
+    // The Summarize* family adds the samples of one sensor in a range to `s`
+    // and, when asked for, to the sketch `hist`.
+    void SummarizeRollups(const char* table, int sensor, int64_t from_bucket, int64_t to_bucket, Summary& s, Histogram* hist) {
+        std::string sql = std::string("SELECT SUM(n), SUM(sum), MIN(min), MAX(max) FROM ") + table +
+                          " WHERE bucket >= ? AND bucket < ? AND sensor = ?;";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, from_bucket);
+            sqlite3_bind_int64(stmt, 2, to_bucket);
+            sqlite3_bind_int(stmt, 3, sensor);
+            if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+                Summary r;
+                r.n = sqlite3_column_int64(stmt, 0);
+                r.sum = sqlite3_column_int64(stmt, 1);
+                r.min = sqlite3_column_int64(stmt, 2);
+                r.max = sqlite3_column_int64(stmt, 3);
+                s.Merge(r);
+            }
+        }
+        sqlite3_finalize(stmt);
+        if (!hist) return;
+
+        sql = std::string("SELECT hist FROM ") + table + " WHERE bucket >= ? AND bucket < ? AND sensor = ? AND hist IS NOT NULL;";
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, from_bucket);
+            sqlite3_bind_int64(stmt, 2, to_bucket);
+            sqlite3_bind_int(stmt, 3, sensor);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                hist->Decode(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    void SummarizeRaw(int sensor, int64_t from, int64_t to, Summary& s, Histogram* hist) {
+        std::function<void(const Sample&)> add = [&](const Sample& x) {
+            s.Add(x.value, x.Count());
+            if (hist) hist->Add(x.value, (uint32_t)x.Count());
+        };
+        ScanBlocks(sensor, from, to, add);
+        ScanLog(sensor, from, to, add);
+    }
+
+    void SummarizeArchives(int sensor, int64_t from, int64_t to, Summary& s, Histogram* hist) {
+        ScanArchives(sensor, from, to, [&](const Sample& x) {
+            s.Add(x.value, x.Count());
+            if (hist) hist->Add(x.value, (uint32_t)x.Count());
+        });
+    }
+
+    void SummarizeTail(int sensor, int64_t from_minute, int64_t to_minute, Summary& s, Histogram* hist) {
+        std::map<std::pair<int, int64_t>, TailBucket>::const_iterator it = tail.lower_bound(std::make_pair(sensor, from_minute));
+        for (; it != tail.end() && it->first < std::make_pair(sensor, to_minute); ++it) {
+            s.Merge(it->second.summary);
+            if (hist) hist->Merge(it->second.hist);
+        }
+    }
+
+    // Earliest time from which `tier` still holds complete data.
+    int64_t TierStart(int tier) {
+        int64_t now = g_clock.Now();
+        if (tier == TIER_RAW) return retention.raw_days > 0 ? FirstLiveDay() * MS_PER_DAY : INT64_MIN;
+        if (tier == TIER_MINUTE && retention.minute_days > 0) {
+            return (now - retention.minute_days * MS_PER_DAY) / MS_PER_MINUTE * MS_PER_MINUTE;
+        }
+        if (tier == TIER_HOUR && retention.hour_days > 0) {
+            return (now - retention.hour_days * MS_PER_DAY) / MS_PER_HOUR * MS_PER_HOUR;
+        }
+        return INT64_MIN;
+    }
+
+    // Samples per millisecond over the sensor's recent ring; 1 Hz when it
+    // can't tell.
+    double SampleRate(int sensor) {
+        std::vector<Sample> latest = Recent(sensor, 64);
+        if (latest.size() < 2 || latest.front().time <= latest.back().time) return 0.001;
+        return (latest.size() - 1) / (double)(latest.front().time - latest.back().time);
+    }
+
+    int64_t StepCost(int tier, int64_t from, int64_t to, double rate) {
+        if (tier == TIER_ARCHIVE) {
+            // Row groups are a day each and are decoded whole.
+            int64_t days = (to - 1) / MS_PER_DAY - from / MS_PER_DAY + 1;
+            return PLAN_STEP_COST * days + (int64_t)(rate * days * MS_PER_DAY);
+        }
+        if (tier == TIER_RAW) {
+            // Blocks are decoded whole, and each day is another partition.
+            int64_t hours = (to - 1) / MS_PER_HOUR - from / MS_PER_HOUR + 1;
+            int64_t days = (to - 1) / MS_PER_DAY - from / MS_PER_DAY + 1;
+            return PLAN_STEP_COST * days + (int64_t)(rate * hours * MS_PER_HOUR);
+        }
+        int64_t buckets = (to - from) / TIERS[tier].unit;
+        return PLAN_STEP_COST + std::min(buckets, (int64_t)(rate * (to - from)) + 1);
+    }
+
+    // Cheapest plan for [from, to) using `tier` and the tiers finer than it:
+    // either everything one tier down, or this tier's whole buckets with the
+    // ragged ends planned one tier down. When no finer tier can answer an
+    // end exactly, the range is widened to this tier's buckets instead.
+    // Appends the steps and returns their cost.
+    int64_t PlanRange(int64_t from, int64_t to, int tier, double rate, std::vector<PlanStep>& steps) {
+        if (from >= to) return 0;
+        if (tier == TIER_RAW) {
+            // Raw data retention has dropped is read from archives, if any hold it.
+            int64_t live = std::max(from, std::min(to, TierStart(TIER_RAW)));
+            int64_t cost = 0;
+            if (from < live) {
+                PlanStep step = { TIER_ARCHIVE, from, live, StepCost(TIER_ARCHIVE, from, live, rate), false };
+                if (!ArchivesCover(from, live)) step.cost = PLAN_IMPOSSIBLE;
+                steps.push_back(step);
+                cost += step.cost;
+            }
+            if (live < to) {
+                PlanStep step = { TIER_RAW, live, to, StepCost(TIER_RAW, live, to, rate), false };
+                steps.push_back(step);
+                cost += step.cost;
+            }
+            return cost;
+        }
+
+        int64_t unit = TIERS[tier].unit;
+        int64_t a = (from + unit - 1) / unit * unit, b = to / unit * unit;
+        bool available = (from / unit * unit >= TierStart(tier));
+        std::vector<PlanStep> best;
+        int64_t best_cost = PlanRange(from, to, tier + 1, rate, best);
+        if (a < b && available) {
+            std::vector<PlanStep> split;
+            PlanStep middle = { tier, a, b, StepCost(tier, a, b, rate), false };
+            int64_t cost = PlanRange(from, a, tier + 1, rate, split) + middle.cost;
+            split.push_back(middle);
+            cost += PlanRange(b, to, tier + 1, rate, split);
+            if (cost < best_cost) {
+                best.swap(split);
+                best_cost = cost;
+            }
+        }
+        if (best_cost >= PLAN_IMPOSSIBLE && available) {
+            PlanStep whole = { tier, from / unit * unit, (to + unit - 1) / unit * unit, 0, true };
+            whole.cost = PLAN_WIDENED + StepCost(tier, whole.from, whole.to, rate);
+            best.assign(1, whole);
+            best_cost = whole.cost;
+        }
+        steps.insert(steps.end(), best.begin(), best.end());
+        return best_cost;
+    }
+
+    // Steps in time order; a plan whose cost reaches PLAN_IMPOSSIBLE has
+    // parts nothing can answer any more, which read as empty.
+    std::vector<PlanStep> Plan(int sensor, int64_t from, int64_t to) {
+        std::vector<PlanStep> steps;
+        PlanRange(from, to, TIER_DAY, SampleRate(sensor), steps);
+        return steps;
+    }
+
+    // Rollups cover the sealed rows of a rollup step and the tail its
+    // unsealed ones; raw steps read blocks and log partitions, archive steps
+    // Parquet files.
+    void Execute(int sensor, const std::vector<PlanStep>& steps, Summary& s, Histogram* hist) {
+        for (size_t i = 0; i < steps.size(); i++) {
+            const PlanStep& step = steps[i];
+            if (step.tier == TIER_RAW) {
+                SummarizeRaw(sensor, step.from, step.to, s, hist);
+                continue;
+            }
+            if (step.tier == TIER_ARCHIVE) {
+                SummarizeArchives(sensor, step.from, step.to, s, hist);
+                continue;
+            }
+            int64_t unit = TIERS[step.tier].unit;
+            SummarizeRollups(TIERS[step.tier].table, sensor, step.from / unit, step.to / unit, s, hist);
+            SummarizeTail(sensor, step.from / MS_PER_MINUTE, step.to / MS_PER_MINUTE, s, hist);
+        }
+    }
+
+    // "hour 2024-05-01T10:00Z..2024-05-01T14:00Z ~4; raw ..." for debugging.
+    static std::string DescribePlan(const std::vector<PlanStep>& steps) {
+        std::stringstream out;
+        for (size_t i = 0; i < steps.size(); i++) {
+            if (i > 0) out << "; ";
+            out << TIERS[steps[i].tier].name << " " << FormatUtc(steps[i].from) << ".." << FormatUtc(steps[i].to);
+            if (steps[i].cost >= PLAN_IMPOSSIBLE) out << " expired";
+            else out << " ~" << steps[i].cost % PLAN_WIDENED << (steps[i].widened ? " widened" : "");
+        }
+        return out.str();
+    }
+
+    void Summarize(int sensor, int64_t from, int64_t to, Summary& s, Histogram* hist) {
+        Execute(sensor, Plan(sensor, from, to), s, hist);
+    }
+
+    // `fn` over the samples of `sensor` in [from, to): count, sum, avg, min,
+    // max or a percentile such as p50 or p99.9. Returns false for an unknown
+    // fn; `value` is NAN when the range holds no samples. `plan`, when given,
+    // receives the description of the plan used.
+    bool Aggregate(int sensor, int64_t from, int64_t to, const std::string& fn, double& value, std::string* plan) {
+        double q = 0;
+        bool percentile = fn.size() > 1 && fn[0] == 'p';
+        if (percentile) {
+            char* end;
+            q = strtod(fn.c_str() + 1, &end) / 100.0;
+            if (*end || q < 0 || q > 1) return false;
+        } else if (fn != "count" && fn != "sum" && fn != "avg" && fn != "min" && fn != "max") {
+            return false;
+        }
+
+        std::vector<PlanStep> steps = Plan(sensor, from, to);
+        if (plan) *plan = DescribePlan(steps);
+        Summary s;
+        Histogram hist;
+        Execute(sensor, steps, s, percentile ? &hist : nullptr);
+
+        value = NAN;
+        if (fn == "count") value = (double)s.n;
+        else if (s.n == 0) return true;
+        else if (fn == "sum") value = FromFixed(s.sum);
+        else if (fn == "avg") value = FromFixed(s.sum) / s.n;
+        else if (fn == "min") value = FromFixed(s.min);
+        else if (fn == "max") value = FromFixed(s.max);
+        else if (hist.total > 0) value = FromFixed(hist.Percentile(q));
+        return true;
+    }
+
+    std::string GetAverage(int sensor, time_t seconds_back) {
+        std::string result = "--";
+        int64_t now = g_clock.Now();
+        Summary s;
+        Summarize(sensor, now - seconds_back * 1000 + 1, now + 1, s, nullptr);
+
+        if (s.n > 0) {
+            char buf[32];
+            sprintf(buf, "%.2f", FromFixed(s.sum) / s.n);
+            result = std::string(buf);
+        }
+        return result;
+    }
+
+    // p50, p95 and p99 over the window, e.g. "21.3 / 24.0 / 25.1".
+    std::string GetPercentiles(int sensor, time_t seconds_back) {
+        int64_t now = g_clock.Now();
+        Summary s;
+        Histogram hist;
+        Summarize(sensor, now - seconds_back * 1000 + 1, now + 1, s, &hist);
+        if (hist.total == 0) return "--";
+
+        char buf[64];
+        sprintf(buf, "%.1f / %.1f / %.1f", FromFixed(hist.Percentile(0.50)),
+                FromFixed(hist.Percentile(0.95)), FromFixed(hist.Percentile(0.99)));
+        return buf;
+    }
+
+    std::string GetPercentilesJSON(int sensor, time_t seconds_back) {
+        int64_t now = g_clock.Now();
+        Summary s;
+        Histogram hist;
+        Summarize(sensor, now - seconds_back * 1000 + 1, now + 1, s, &hist);
+
+        std::stringstream json;
+        json << "{\"sensor\":" << sensor << ",\"seconds\":" << (long long)seconds_back << ",\"count\":" << hist.total;
+        if (hist.total > 0) {
+            json << ",\"min\":" << FromFixed(s.min) << ",\"max\":" << FromFixed(s.max)
+                 << ",\"p50\":" << FromFixed(hist.Percentile(0.50))
+                 << ",\"p95\":" << FromFixed(hist.Percentile(0.95))
+                 << ",\"p99\":" << FromFixed(hist.Percentile(0.99));
+        }
+        json << "}";
+        return json.str();
+    }
+
+    std::string GetHistoryHTML(int sensor) {
+        std::stringstream html;
+
+        html << "<table><tr><th>Time</th><th>Temp</th></tr>";
+
+        std::vector<Sample> rows = Recent(sensor, 10);
+        for (size_t i = 0; i < rows.size(); i++) {
+            time_t t = (time_t)(rows[i].time / 1000);
+
+            char buf[100];
+            struct tm* tm_info = localtime(&t);
+            strftime(buf, sizeof(buf), "%H:%M:%S", tm_info);
+
+            html << "<tr><td>" << buf << "</td><td>" << FromFixed(rows[i].value) << "</td></tr>";
+        }
+        html << "</table>";
+        return html.str();
+    }
+};
+
+#endif
@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "frame.h"
 
 #ifdef _WIN32
     #include <winsock2.h>
@@ -23,6 +27,13 @@
         closesocket(s);
     }
 
+    // Whatever datagram is waiting, or -1 straight away when there is none.
+    int recv_nowait(MySocket s, char* buf, int size) {
+        u_long pending = 0;
+        if (ioctlsocket(s, FIONREAD, &pending) != 0 || pending == 0) return -1;
+        return recv(s, buf, size, 0);
+    }
+
 #else
     #include <sys/socket.h>
     #include <arpa/inet.h>
@@ -35,9 +46,11 @@
     void init_network_lib() {}
     void close_network_lib() {}
     void close_socket(MySocket s) { close(s); }
+    int recv_nowait(MySocket s, char* buf, int size) { return recv(s, buf, size, MSG_DONTWAIT); }
 #endif
 
 struct sockaddr_in g_server_addr;
+int g_verbose = 0;
 
 MySocket create_udp_socket(const char* ip, int port) {
     MySocket s = socket(AF_INET, SOCK_DGRAM, 0);
@@ -60,17 +73,45 @@ MySocket create_udp_socket(const char* ip, int port) {
     return s;
 }
 
-void send_udp_message(MySocket s, const char* msg) {
-    int sent_bytes = sendto(s, msg, strlen(msg), 0, 
+int send_udp_datagram(MySocket s, const char* data, int len) {
+    int sent_bytes = sendto(s, data, len, 0, 
                            (struct sockaddr*)&g_server_addr, sizeof(g_server_addr));
                            
     if (sent_bytes < 0) {
         printf("Failed to send UDP packet\n");
-    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void send_udp_message(MySocket s, const char* msg) {
+    if (send_udp_datagram(s, msg, (int)strlen(msg)) && g_verbose) {
         printf("Sent to server: %s\n", msg);
     }
 }
 
+/* Largest UDP payload that fits the path MTU to the server without IP
+   fragmentation. Linux reports the path MTU on a connected socket; elsewhere
+   assume Ethernet. */
+int datagram_limit(MySocket s) {
+#ifdef IP_MTU
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    if (connect(s, (struct sockaddr*)&g_server_addr, sizeof(g_server_addr)) == 0 &&
+        getsockopt(s, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 && mtu > 28) {
+        return mtu - 28 < 65507 ? mtu - 28 : 65507;
+    }
+#else
+    (void)s;
+#endif
+    return 1500 - 28;
+}
+
+#define MAX_DEVICES 64
+
+int g_baud = 9600;
+int g_framed = 0; /* serial input is frame.h frames rather than text lines */
+
 #ifdef _WIN32
     #include <windows.h>
 
@@ -78,6 +119,23 @@ void send_udp_message(MySocket s, const char* msg) {
     #define BAD_PORT INVALID_HANDLE_VALUE
     #define PAUSE(ms) Sleep(ms)
 
+    // How long ReadFile waits for a first byte; 0 returns straight away.
+    int g_read_timeout_ms = 1000;
+    unsigned long g_read_total = 0;
+
+    long long now_ms() { return (long long)GetTickCount64(); }
+
+    /* Any rate the driver takes; 0 when it makes no sense. */
+    DWORD baud_constant(int baud) { return baud > 0 ? (DWORD)baud : 0; }
+
+    // Epoch microseconds, the clock readings are stamped with.
+    long long wall_us() {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        unsigned long long t = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+        return (long long)(t / 10 - 11644473600000000ULL);
+    }
+
     MyPort connect_port(const char* name) {
         HANDLE h = CreateFileA(name,
             GENERIC_READ | GENERIC_WRITE,
@@ -94,30 +152,72 @@ void send_udp_message(MySocket s, const char* msg) {
         DCB cfg = {0};
         cfg.DCBlength = sizeof(cfg);
         GetCommState(h, &cfg);
-        cfg.BaudRate = CBR_9600;
+        cfg.BaudRate = baud_constant(g_baud);
         cfg.ByteSize = 8;
         cfg.StopBits = ONESTOPBIT;
         cfg.Parity = NOPARITY;
         SetCommState(h, &cfg);
 
+        // ReadFile returns as soon as any bytes are there, or after
+        // g_read_timeout_ms of silence with none.
         COMMTIMEOUTS timeouts = {0};
-        timeouts.ReadIntervalTimeout = 50;
-        timeouts.ReadTotalTimeoutConstant = 50;
-        timeouts.ReadTotalTimeoutMultiplier = 10;
+        timeouts.ReadIntervalTimeout = MAXDWORD;
+        if (g_read_timeout_ms > 0) {
+            timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+            timeouts.ReadTotalTimeoutConstant = g_read_timeout_ms;
+        }
         SetCommTimeouts(h, &timeouts);
 
         return h;
     }
 
+    // Bytes read, 0 on timeout, -1 on error.
     int read_data(MyPort p, char* buffer, int size) {
         unsigned long read;
         
         if(!ReadFile(p, buffer, size, &read, NULL)) {
-            return 0;
+            return -1;
         }
+        g_read_total += read;
         return (int)read;
     }
 
+    MyPort g_watched[MAX_DEVICES];
+    int g_watch_count = 0;
+
+    void watch_port(MyPort p, int index) {
+        g_watched[index] = p;
+        if (index >= g_watch_count) g_watch_count = index + 1;
+    }
+
+    void unwatch_port(MyPort p, int index) {
+        (void)p;
+        g_watched[index] = BAD_PORT;
+    }
+
+    // Acks are picked up on every pass instead.
+    void watch_socket(MySocket s) {
+        (void)s;
+    }
+
+    // Comm handles can't be waited on together without overlapped I/O, so
+    // every open port counts as ready. A lone port blocks in ReadFile (see
+    // the timeouts above); several are opened with g_read_timeout_ms 0 and
+    // the loop naps whenever a whole pass over them read nothing.
+    int wait_ports(int* ready, int max, int timeout_ms) {
+        static unsigned long last_total = 0;
+        if (g_watch_count > 1 && g_read_total == last_total) {
+            PAUSE(timeout_ms >= 0 && timeout_ms < 5 ? timeout_ms : 5);
+        }
+        last_total = g_read_total;
+
+        int n = 0;
+        for (int i = 0; i < g_watch_count && n < max; i++) {
+            if (g_watched[i] != BAD_PORT) ready[n++] = i;
+        }
+        return n;
+    }
+
     void disconnect(MyPort p) {
         CloseHandle(p);
     }
@@ -126,36 +226,117 @@ void send_udp_message(MySocket s, const char* msg) {
     #include <unistd.h>
     #include <fcntl.h>
     #include <termios.h>
+    #include <sys/epoll.h>
 
     typedef int MyPort;
     #define BAD_PORT -1
     #define PAUSE(ms) usleep((ms) * 1000)
 
+    #include <errno.h>
+
+    int g_read_timeout_ms = 1000; /* Windows only */
+
+    long long now_ms() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // Epoch microseconds, the clock readings are stamped with.
+    long long wall_us() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    /* termios constant for a baud rate; 0 when this platform lacks it. */
+    speed_t baud_constant(int baud) {
+        switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+#ifdef B460800
+        case 460800: return B460800;
+#endif
+#ifdef B921600
+        case 921600: return B921600;
+#endif
+        }
+        return 0;
+    }
+
     MyPort connect_port(const char* name) {
+        // O_NDELAY only so open() doesn't wait for carrier; reads block.
         int id = open(name, O_RDWR | O_NOCTTY | O_NDELAY);
 
         if(id == -1) {
             return BAD_PORT;
         }
+        fcntl(id, F_SETFL, fcntl(id, F_GETFL) & ~O_NDELAY);
 
         struct termios cfg;
         
         tcgetattr(id, &cfg);
-        cfsetispeed(&cfg, B9600);
-        cfsetospeed(&cfg, B9600);
+        cfsetispeed(&cfg, baud_constant(g_baud));
+        cfsetospeed(&cfg, baud_constant(g_baud));
 
         cfg.c_cflag &= ~PARENB;
         cfg.c_cflag &= ~CSTOPB;
         cfg.c_cflag &= ~CSIZE;
-        cfg.c_cflag |= CS8;
+        cfg.c_cflag |= CS8 | CLOCAL | CREAD;
         cfg.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+        cfg.c_iflag &= ~(IXON | IXOFF | IXANY | ICRNL | INLCR | IGNCR | ISTRIP);
+        cfg.c_oflag &= ~OPOST;
+
+        // Sleep in read() until at least one byte arrives, then return
+        // whatever is buffered: no polling, no added latency.
+        cfg.c_cc[VMIN] = 1;
+        cfg.c_cc[VTIME] = 0;
 
         tcsetattr(id, TCSANOW, &cfg);
         return id;
     }
 
+    // Bytes read, 0 when interrupted, -1 on error or hangup.
     int read_data(MyPort p, char* buffer, int size) {
-        return read(p, buffer, size); 
+        int n = read(p, buffer, size);
+        if (n < 0 && errno == EINTR) return 0;
+        return n > 0 ? n : -1;
+    }
+
+    int g_epoll = -1;
+
+    // Adds a port to the set wait_ports() sleeps on.
+    void watch_port(MyPort p, int index) {
+        if (g_epoll < 0) g_epoll = epoll_create1(0);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (unsigned)index;
+        epoll_ctl(g_epoll, EPOLL_CTL_ADD, p, &ev);
+    }
+
+    void unwatch_port(MyPort p, int index) {
+        (void)index;
+        epoll_ctl(g_epoll, EPOLL_CTL_DEL, p, NULL);
+    }
+
+    // Wakes wait_ports() when an ack arrives; it reports it as MAX_DEVICES.
+    void watch_socket(MySocket s) {
+        watch_port(s, MAX_DEVICES);
+    }
+
+    // Fills `ready` with the indexes of ports that have data (or have
+    // failed; the read says which), 0 after timeout_ms (-1 waits forever).
+    int wait_ports(int* ready, int max, int timeout_ms) {
+        struct epoll_event ev[MAX_DEVICES + 1];
+        if (max > MAX_DEVICES + 1) max = MAX_DEVICES + 1;
+        int n = epoll_wait(g_epoll, ev, max, timeout_ms);
+        for (int i = 0; i < n; i++) ready[i] = (int)ev[i].data.u32;
+        return n > 0 ? n : 0;
     }
 
     void disconnect(MyPort p) {
@@ -164,47 +345,664 @@ void send_udp_message(MySocket s, const char* msg) {
 
 #endif
 
+// Serial input is read in blocks into a ring and cut into lines here.
+// Lines longer than MAX_LINE are dropped whole (up to their newline) rather
+// than split into bogus readings; a trailing '\r' is stripped.
+#define RING_SIZE 4096 /* power of two */
+#define MAX_LINE 63
+
+typedef struct {
+    char data[RING_SIZE];
+    unsigned head;     /* bytes written so far */
+    unsigned tail;     /* bytes consumed so far */
+    unsigned scan;     /* bytes already searched for a newline */
+    int dropping;      /* inside an over-long line */
+    unsigned long dropped;
+} LineRing;
+
+/* Reads whatever the port has into the free part of the ring. */
+int ring_fill(LineRing* r, MyPort port) {
+    unsigned used = r->head - r->tail;
+    unsigned at = r->head & (RING_SIZE - 1);
+    unsigned room = RING_SIZE - used;
+    if (room > RING_SIZE - at) room = RING_SIZE - at;
+    int n = read_data(port, r->data + at, (int)room);
+    if (n > 0) r->head += n;
+    return n;
+}
+
+/* Copies the next complete line into `line` (MAX_LINE + 1 bytes); returns 0
+   when there is none yet. */
+int ring_next_line(LineRing* r, char* line) {
+    while (r->scan != r->head) {
+        if (r->data[r->scan++ & (RING_SIZE - 1)] != '\n') continue;
+
+        unsigned len = r->scan - 1 - r->tail;
+        int keep = !r->dropping && len <= MAX_LINE;
+        if (!r->dropping && len > MAX_LINE) r->dropped++;
+        for (unsigned i = 0; keep && i < len; i++) line[i] = r->data[(r->tail + i) & (RING_SIZE - 1)];
+        r->tail = r->scan;
+        r->dropping = 0;
+        if (!keep) continue;
+
+        if (len > 0 && line[len - 1] == '\r') len--;
+        line[len] = '\0';
+        return 1;
+    }
+    if (!r->dropping && r->head - r->tail > MAX_LINE) {
+        r->dropping = 1;
+        r->dropped++;
+    }
+    if (r->dropping) r->tail = r->head;
+    return 0;
+}
+
+/* Framed input: bytes before a sync byte are skipped, and a frame with a bad
+   length or CRC gives up only its sync byte, so the search for the next one
+   starts inside it (see frame.h). */
+typedef struct {
+    unsigned long frames;
+    unsigned long bad_length;
+    unsigned long bad_crc;
+    unsigned long skipped;  /* bytes passed over looking for a sync byte */
+} FrameCounts;
+
+unsigned char ring_at(const LineRing* r, unsigned i) {
+    return (unsigned char)r->data[(r->tail + i) & (RING_SIZE - 1)];
+}
+
+/* Copies the payload of the next good frame into `payload` (FRAME_MAX_PAYLOAD
+   bytes) and returns its length; 0 when there is no whole frame yet. */
+int ring_next_frame(LineRing* r, unsigned char* payload, FrameCounts* c) {
+    while (r->head != r->tail) {
+        unsigned avail = r->head - r->tail;
+        if (ring_at(r, 0) != FRAME_SYNC) {
+            r->tail++;
+            c->skipped++;
+            continue;
+        }
+        if (avail < 2) return 0;
+        int len = ring_at(r, 1);
+        if (len == 0 || len > FRAME_MAX_PAYLOAD) {
+            r->tail++;
+            c->bad_length++;
+            continue;
+        }
+        if (avail < (unsigned)len + FRAME_OVERHEAD) return 0;
+        uint16_t crc = 0xFFFF;
+        for (int i = 1; i < len + 2; i++) crc = frame_crc_add(crc, ring_at(r, i));
+        if (crc != (ring_at(r, len + 2) | ring_at(r, len + 3) << 8)) {
+            r->tail++;
+            c->bad_crc++;
+            continue;
+        }
+        for (int i = 0; i < len; i++) payload[i] = ring_at(r, 2 + i);
+        r->tail += len + FRAME_OVERHEAD;
+        c->frames++;
+        return len;
+    }
+    return 0;
+}
+
+/* Reliable mode: every reading gets a sequence number and stays in a
+   fixed-size ring file until the server acks it, so an outage or a restart of
+   either side loses nothing unless the ring overflows. The file is a header
+   (magic, sender id, capacity, acked, next) and `capacity` records of
+   {seq, reading} in protocol.h byte order. Readings keep the time they came
+   in (epoch microseconds), so a replay hours later still stores them at the
+   right time. */
+#define SPOOL_HEADER 32
+#define SPOOL_RECORD (8 + PROTO_READING)
+#define REPLAY_WINDOW 4096      /* readings past the ack resent at a time */
+#define REPLAY_TIMEOUT_MS 1000  /* ack silence that starts a replay */
+
+typedef struct {
+    FILE* file;
+    uint32_t sender;
+    uint32_t capacity;
+    uint64_t acked;         /* the server has everything below this */
+    uint64_t next;          /* number of the next reading */
+    uint64_t replay;        /* next one to resend; == next when caught up */
+    long long progress_ms;  /* when acked last moved */
+    unsigned long overflowed;
+    uint32_t rtt_us;        /* smallest ack round trip of the last two rounds */
+    uint32_t rtt_round;     /* smallest of the current round of RTT_ROUND acks */
+    int rtt_acks;
+} Spool;
+
+#define RTT_ROUND 64
+
+Spool g_spool; /* file is NULL unless reliable */
+int g_numbered = 0; /* binary datagrams: -seq, or -reliable */
+
+uint32_t new_sender_id() {
+    srand((unsigned)time(NULL) ^ (unsigned)now_ms());
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand() ^ (uint32_t)time(NULL);
+}
+
+void spool_sync(Spool* s) {
+    unsigned char h[SPOOL_HEADER];
+    memset(h, 0, sizeof(h));
+    memcpy(h, "TSP3", 4);
+    proto_put32(h + 4, s->sender);
+    proto_put32(h + 8, s->capacity);
+    proto_put64(h + 16, s->acked);
+    proto_put64(h + 24, s->next);
+    fseek(s->file, 0, SEEK_SET);
+    fwrite(h, 1, sizeof(h), s->file);
+    fflush(s->file);
+}
+
+int spool_open(Spool* s, const char* path, uint32_t capacity) {
+    unsigned char h[SPOOL_HEADER];
+    s->file = fopen(path, "r+b");
+    size_t got = s->file ? fread(h, 1, sizeof(h), s->file) : 0;
+    if (got == sizeof(h) && memcmp(h, "TSP3", 4) == 0) {
+        s->sender = proto_get32(h + 4);
+        s->capacity = proto_get32(h + 8);
+        s->acked = proto_get64(h + 16);
+        s->next = proto_get64(h + 24);
+    } else if (got > 0) {
+        printf("%s is not a spool file\n", path);
+        fclose(s->file);
+        s->file = NULL;
+        return 0;
+    } else {
+        if (s->file) fclose(s->file);
+        s->file = fopen(path, "w+b");
+        if (!s->file) {
+            printf("Can't create spool file %s\n", path);
+            return 0;
+        }
+        s->sender = new_sender_id();
+        s->capacity = capacity;
+        s->acked = s->next = 0;
+        spool_sync(s);
+    }
+    s->replay = s->acked; /* anything unacked goes out again */
+    s->progress_ms = now_ms();
+    return 1;
+}
+
+uint64_t spool_append(Spool* s, int32_t sensor, float value, int64_t time, uint32_t repeats) {
+    if (s->next - s->acked == s->capacity) {
+        s->acked++; /* full: the oldest reading is lost */
+        s->overflowed++;
+    }
+    unsigned char r[SPOOL_RECORD];
+    proto_put64(r, s->next);
+    proto_write_reading(r + 8, sensor, value, time, repeats);
+    fseek(s->file, SPOOL_HEADER + (long)(s->next % s->capacity) * SPOOL_RECORD, SEEK_SET);
+    fwrite(r, 1, sizeof(r), s->file);
+    return s->next++;
+}
+
+int spool_read(Spool* s, uint64_t seq, int32_t* sensor, float* value, int64_t* time, uint32_t* repeats) {
+    unsigned char r[SPOOL_RECORD];
+    fseek(s->file, SPOOL_HEADER + (long)(seq % s->capacity) * SPOOL_RECORD, SEEK_SET);
+    if (fread(r, 1, sizeof(r), s->file) != sizeof(r) || proto_get64(r) != seq) return 0;
+    proto_read_reading(r + 8, sensor, value, time, repeats);
+    return 1;
+}
+
+/* Readings waiting to go out as one datagram: one per line, or numbered
+   records after a protocol.h header. */
+typedef struct {
+    char data[65536];
+    int len;
+    int limit;
+    int count;
+    long long first_ms;
+    uint64_t first_seq;
+} Batch;
+
+void batch_flush(Batch* b, MySocket sock) {
+    if (b->count == 0) return;
+    if (g_numbered) {
+        ProtoHeader h = { (uint8_t)(g_spool.file ? PROTO_DATA : PROTO_STREAM), (uint16_t)b->count,
+                          g_spool.sender, b->first_seq, g_spool.acked, wall_us(), g_spool.rtt_us };
+        proto_write_header((unsigned char*)b->data, &h);
+        if (g_spool.file) spool_sync(&g_spool); /* a number handed out is never reused */
+        if (send_udp_datagram(sock, b->data, b->len) && g_verbose) {
+            printf("Sent readings %llu-%llu\n", (unsigned long long)b->first_seq,
+                   (unsigned long long)(b->first_seq + b->count - 1));
+        }
+    } else {
+        b->data[b->len] = '\0';
+        send_udp_message(sock, b->data);
+    }
+    b->len = 0;
+    b->count = 0;
+}
+
+void batch_add_numbered(Batch* b, MySocket sock, uint64_t seq, int32_t sensor, float value, int64_t time,
+                        uint32_t repeats) {
+    if (b->count > 0 && (b->len + PROTO_READING > b->limit || seq != b->first_seq + b->count)) {
+        batch_flush(b, sock);
+    }
+    if (b->count == 0) {
+        b->first_ms = now_ms();
+        b->first_seq = seq;
+        b->len = PROTO_HEADER;
+    }
+    proto_write_reading((unsigned char*)b->data + b->len, sensor, value, time, repeats);
+    b->len += PROTO_READING;
+    b->count++;
+}
+
+/* Moves the ack forward from whatever acks have arrived, and measures the
+   round trip from the send time each one echoes, less the time the server
+   says it held the datagram. The smallest recent one tells the server how
+   much of the delay it sees is the network's. */
+void spool_read_acks(Spool* s, MySocket sock) {
+    unsigned char buf[64];
+    ProtoHeader h;
+    int n, moved = 0;
+    while ((n = recv_nowait(sock, (char*)buf, sizeof(buf))) > 0) {
+        if (!proto_read_header(buf, n, &h) || h.type != PROTO_ACK || h.sender != s->sender) continue;
+        long long rtt = wall_us() - h.time - h.rtt;
+        if (rtt >= 0 && rtt < 60000000) {
+            if (s->rtt_acks == 0 || rtt < s->rtt_round) s->rtt_round = (uint32_t)rtt;
+            if (s->rtt_us == 0 || s->rtt_round < s->rtt_us) s->rtt_us = s->rtt_round;
+            if (++s->rtt_acks == RTT_ROUND) {
+                s->rtt_us = s->rtt_round; /* forget rounds before the last */
+                s->rtt_acks = 0;
+            }
+        }
+        if (h.seq > s->acked && h.seq <= s->next) {
+            s->acked = h.seq;
+            moved = 1;
+        }
+    }
+    if (moved) {
+        s->progress_ms = now_ms();
+        spool_sync(s);
+    }
+}
+
+/* Resends unacked readings oldest first, at most REPLAY_WINDOW past the ack
+   so the server's window can take them all; each ack lets more go. When the
+   ack stops moving, starts over from it. */
+void spool_replay(Spool* s, Batch* b, MySocket sock) {
+    long long now = now_ms();
+    if (s->acked == s->next) {
+        s->replay = s->next;
+        s->progress_ms = now; /* the clock starts when something is unacked */
+        return;
+    }
+    if (now - s->progress_ms >= REPLAY_TIMEOUT_MS) {
+        s->replay = s->acked;
+        s->progress_ms = now;
+    }
+    if (s->replay < s->acked) s->replay = s->acked;
+    for (; s->replay < s->next && s->replay < s->acked + REPLAY_WINDOW; s->replay++) {
+        int32_t sensor;
+        float value;
+        int64_t time;
+        uint32_t repeats;
+        if (spool_read(s, s->replay, &sensor, &value, &time, &repeats)) {
+            batch_add_numbered(b, sock, s->replay, sensor, value, time, repeats);
+        }
+    }
+    batch_flush(b, sock);
+}
+
+void batch_add(Batch* b, MySocket sock, const char* line) {
+    int len = (int)strlen(line);
+    if (b->count > 0 && b->len + len + 1 > b->limit) batch_flush(b, sock);
+    if (b->count == 0) b->first_ms = now_ms();
+    memcpy(b->data + b->len, line, len);
+    b->len += len;
+    b->data[b->len++] = '\n';
+    b->count++;
+}
+
+/* One sensor's readings on their way out: the id they are tagged with and
+   the deadband state. */
+typedef struct {
+    int id;             /* -1 sends bare values, as a lone device does */
+    /* Deadband (-deadband): readings within it of the last one sent are held
+       back and later sent as one reading standing for all of them. */
+    int has_sent;
+    float sent_value;
+    char sent_text[MAX_LINE + 1];
+    uint32_t held;          /* readings held back since the last one sent */
+    int64_t held_time;      /* capture time of the newest of them */
+    long long sent_ms;      /* when the stream last sent anything */
+} Stream;
+
+/* One serial port. Its readings are one stream tagged with the port's id,
+   except frames with a channel (see frame.h), which come from a link shared
+   by several sensors and are tagged with the channel instead. */
+typedef struct {
+    char name[256];
+    Stream stream;
+    Stream* channels;   /* by channel, grown as channels show up */
+    int channel_count;
+    MyPort port;
+    long long retry_ms; /* when to try reopening a lost port */
+    long long beat_ms;  /* when a held reading is next due out, -1 for none */
+    LineRing ring;
+    unsigned long reported;
+    FrameCounts frame;      /* -framed input */
+    FrameCounts frame_reported;
+    long long report_ms;
+} Device;
+
+float g_deadband = -1;         /* < 0: send every reading */
+int g_heartbeat_ms = 10000;
+
+/* Parses "COM[=ID][,COM[=ID]...]". Devices in a list without an id get
+   their 1-based position; a lone device without one stays untagged. */
+int parse_devices(char* list, Device* devs) {
+    int n = 0, named = 0;
+    for (char* name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        if (n == MAX_DEVICES) {
+            printf("At most %d devices\n", MAX_DEVICES);
+            return 0;
+        }
+        char* eq = strchr(name, '=');
+        if (eq) *eq = '\0';
+        snprintf(devs[n].name, sizeof(devs[n].name), "%s", name);
+        devs[n].stream.id = eq ? atoi(eq + 1) : n + 1;
+        devs[n].port = BAD_PORT;
+        devs[n].beat_ms = -1;
+        if (eq) named = 1;
+        n++;
+    }
+    if (n == 1 && !named) devs[0].stream.id = -1;
+    return n;
+}
+
+/* Frames and forwards one reading, which stands for `repeats` more held
+   back by the deadband. Text readings look like "[ID:]value[*REPEATS]". */
+void send_reading(Stream* st, Batch* batch, MySocket sock, int batching, const char* text, float value,
+                  int64_t captured, uint32_t repeats) {
+    char out[MAX_LINE + 32];
+    int len = st->id >= 0 ? snprintf(out, sizeof(out), "%d:%s", st->id, text)
+                          : snprintf(out, sizeof(out), "%s", text);
+    if (repeats > 0) snprintf(out + len, sizeof(out) - len, "*%u", (unsigned)repeats);
+    if (g_numbered) {
+        uint64_t seq = g_spool.file ? spool_append(&g_spool, st->id, value, captured, repeats) : g_spool.next++;
+        if (g_spool.replay == seq) g_spool.replay++; /* sent live */
+        batch_add_numbered(batch, sock, seq, st->id, value, captured, repeats);
+        if (!batching) batch_flush(batch, sock);
+    } else if (batching) {
+        batch_add(batch, sock, out);
+    } else {
+        send_udp_message(sock, out);
+    }
+    st->sent_ms = now_ms();
+}
+
+/* Sends the readings the deadband has held back as one reading of the value
+   they were held against, at the time of the newest. Aggregates count it
+   as all of them, each off by no more than the deadband. */
+void send_held(Stream* st, Batch* batch, MySocket sock, int batching) {
+    if (st->held == 0) return;
+    send_reading(st, batch, sock, batching, st->sent_text, st->sent_value, st->held_time, st->held - 1);
+    st->held = 0;
+}
+
+/* Sends what the device's streams hold once their heartbeat is due, or all
+   of it when `all`, and notes when the next heartbeat is due. */
+void send_heartbeats(Device* dev, Batch* batch, MySocket sock, int batching, int all) {
+    long long now = now_ms();
+    dev->beat_ms = -1;
+    for (int c = -1; c < dev->channel_count; c++) {
+        Stream* st = c < 0 ? &dev->stream : &dev->channels[c];
+        if (st->held == 0) continue;
+        long long due = st->sent_ms + g_heartbeat_ms;
+        if (all || now >= due) send_held(st, batch, sock, batching);
+        else if (dev->beat_ms < 0 || due < dev->beat_ms) dev->beat_ms = due;
+    }
+}
+
+/* The stream of a channel on a shared link. */
+Stream* channel_stream(Device* dev, int channel) {
+    if (channel >= dev->channel_count) {
+        int count = dev->channel_count ? dev->channel_count : 16;
+        while (count <= channel) count *= 2;
+        Stream* grown = (Stream*)realloc(dev->channels, count * sizeof(Stream));
+        if (!grown) return &dev->stream;
+        memset(grown + dev->channel_count, 0, (count - dev->channel_count) * sizeof(Stream));
+        for (int c = dev->channel_count; c < count; c++) grown[c].id = c;
+        dev->channels = grown;
+        dev->channel_count = count;
+    }
+    return &dev->channels[channel];
+}
+
+/* Sends one reading, or holds it back (see -deadband). */
+void forward_reading(Stream* st, Batch* batch, MySocket sock, int batching, const char* text, float value,
+                     int64_t captured) {
+    if (g_deadband >= 0) {
+        float change = value - st->sent_value;
+        if (st->has_sent && change <= g_deadband && -change <= g_deadband) {
+            st->held++;
+            st->held_time = captured;
+            return;
+        }
+        send_held(st, batch, sock, batching);
+        st->has_sent = 1;
+        st->sent_value = value;
+        snprintf(st->sent_text, sizeof(st->sent_text), "%s", text);
+    }
+    send_reading(st, batch, sock, batching, text, value, captured, 0);
+}
+
+/* Prints a device's frame error counts when they have grown, at most once a
+   second so a noisy line doesn't flood the console. */
+void report_frame_errors(Device* dev) {
+    FrameCounts* c = &dev->frame;
+    FrameCounts* r = &dev->frame_reported;
+    if (c->bad_length == r->bad_length && c->bad_crc == r->bad_crc && c->skipped == r->skipped) return;
+    long long now = now_ms();
+    if (now - dev->report_ms < 1000) return;
+    printf("%s: %lu good frames, %lu bad CRC, %lu bad length, %lu bytes skipped\n", dev->name, c->frames,
+           c->bad_crc, c->bad_length, c->skipped);
+    *r = *c;
+    dev->report_ms = now;
+}
+
+/* Forwards every complete line or frame the device has buffered. Readings
+   from the same read are stamped with the same capture time. */
+void forward_lines(Device* dev, Batch* batch, MySocket sock, int batching) {
+    char line[MAX_LINE + 1];
+    int64_t captured = wall_us();
+    if (g_framed) {
+        unsigned char payload[FRAME_MAX_PAYLOAD];
+        float value;
+        int len, channel;
+        while ((len = ring_next_frame(&dev->ring, payload, &dev->frame)) > 0) {
+            if (!frame_decode(payload, len, &channel, &value)) continue;
+            snprintf(line, sizeof(line), "%g", value);
+            Stream* st = channel >= 0 ? channel_stream(dev, channel) : &dev->stream;
+            forward_reading(st, batch, sock, batching, line, value, captured);
+        }
+        report_frame_errors(dev);
+        return;
+    }
+    while (ring_next_line(&dev->ring, line)) {
+        if (line[0] == '\0') continue;
+        forward_reading(&dev->stream, batch, sock, batching, line, (float)atof(line), captured);
+    }
+    if (dev->ring.dropped != dev->reported) {
+        printf("Dropped %lu over-long lines from %s\n", dev->ring.dropped - dev->reported, dev->name);
+        dev->reported = dev->ring.dropped;
+    }
+}
+
 int main(int argc, char* argv[]) {
-    char* com_name = argv[1];
+    if (argc < 4) {
+        printf("Usage: sender <COM[=ID][,COM[=ID]...]> <SERVER_IP> <PORT> [-batch MS] [-mtu BYTES]\n"
+               "              [-baud RATE] [-framed] [-seq | -reliable SPOOL_FILE] [-spool READINGS]\n"
+               "              [-deadband D] [-heartbeat S] [-v]\n");
+        printf("  COM list: serial ports served by this process; readings are sent as ID:value\n");
+        printf("            (ids default to list position; a lone port without one sends bare values;\n");
+        printf("            framed readings with a channel are tagged with the channel instead)\n");
+        printf("  -baud RATE: serial speed, 9600 (default) to 921600\n");
+        printf("  -framed: ports send CRC-checked binary frames (see frame.h) instead of text lines\n");
+        printf("  -batch MS: pack readings into datagrams, sent when full or MS after the first\n");
+        printf("  -mtu BYTES: path MTU for sizing batches (default: asked from the OS, else 1500)\n");
+        printf("  -seq: number readings so the server can measure loss; nothing is resent\n");
+        printf("  -reliable FILE: number readings, keep them in FILE until acked, replay after outages\n");
+        printf("  -spool READINGS: capacity of a new spool file (default 1048576)\n");
+        printf("  -deadband D: hold back readings within D of the last one sent; a held run goes out\n");
+        printf("               as one reading with a repeat count when the value moves or on a heartbeat\n");
+        printf("  -heartbeat S: longest a device stays silent while readings are held (default 10)\n");
+        printf("  -v: print every datagram sent\n");
+        return 1;
+    }
+    static Device devs[MAX_DEVICES];
+    int count = parse_devices(argv[1], devs);
+    if (count == 0) return 1;
     char* srv_ip = argv[2];
     int srv_port = atoi(argv[3]);
+    int deadline_ms = -1; /* no batching */
+    int mtu = 0;
+    const char* spool_path = NULL;
+    uint32_t spool_size = 1 << 20;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc) deadline_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-mtu") == 0 && i + 1 < argc) mtu = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-baud") == 0 && i + 1 < argc) g_baud = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-framed") == 0) g_framed = 1;
+        else if (strcmp(argv[i], "-seq") == 0) g_numbered = 1;
+        else if (strcmp(argv[i], "-reliable") == 0 && i + 1 < argc) spool_path = argv[++i];
+        else if (strcmp(argv[i], "-spool") == 0 && i + 1 < argc) spool_size = (uint32_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "-deadband") == 0 && i + 1 < argc) g_deadband = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "-heartbeat") == 0 && i + 1 < argc) g_heartbeat_ms = (int)(atof(argv[++i]) * 1000);
+        else if (strcmp(argv[i], "-v") == 0) g_verbose = 1;
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (baud_constant(g_baud) == 0) {
+        printf("Unsupported baud rate %d\n", g_baud);
+        return 1;
+    }
 
     init_network_lib();
     MySocket sock = create_udp_socket(srv_ip, srv_port);
     if (sock == BAD_SOCKET) return 1;
 
-    printf("Connecting to %s...\n", com_name);
-    MyPort port = connect_port(com_name);
-    if (port == BAD_PORT) {
-        printf("Can't open COM port\n");
-        return 1;
+    static Batch batch;
+    batch.limit = mtu > 28 ? mtu - 28 : datagram_limit(sock);
+    if (batch.limit > (int)sizeof(batch.data) - 1) batch.limit = sizeof(batch.data) - 1;
+    if (deadline_ms >= 0) {
+        printf("Batching up to %d bytes or %d ms per datagram\n", batch.limit, deadline_ms);
+    }
+    if (g_deadband >= 0) {
+        if (g_heartbeat_ms <= 0) {
+            printf("Heartbeat must be positive\n");
+            return 1;
+        }
+        printf("Deadband %g, heartbeat every %d ms\n", g_deadband, g_heartbeat_ms);
+    }
+    if (spool_path) {
+        if (spool_size == 0 || spool_size > 100000000) {
+            printf("Spool size must be 1 to 100000000 readings\n");
+            return 1;
+        }
+        if (!spool_open(&g_spool, spool_path, spool_size)) return 1;
+        g_numbered = 1;
+        printf("Reliable delivery as sender %08x, %llu readings unacked in %s\n", (unsigned)g_spool.sender,
+               (unsigned long long)(g_spool.next - g_spool.acked), spool_path);
+        watch_socket(sock);
+    }
+    if (g_numbered && !g_spool.file) {
+        g_spool.sender = new_sender_id();
+        printf("Numbering readings as sender %08x\n", (unsigned)g_spool.sender);
+    }
+    static Batch replay_batch;
+    replay_batch.limit = batch.limit;
+
+    /* Only Windows uses this: a lone port may block in ReadFile until the
+       batch is due (or acks want reading), several must not block at all. */
+    g_read_timeout_ms = count > 1 ? 0 : deadline_ms > 0 ? deadline_ms : 1000;
+    if (g_spool.file && g_read_timeout_ms > 100) g_read_timeout_ms = 100;
+
+    for (int i = 0; i < count; i++) {
+        printf("Connecting to %s...\n", devs[i].name);
+        devs[i].port = connect_port(devs[i].name);
+        if (devs[i].port == BAD_PORT) {
+            printf("Can't open COM port %s\n", devs[i].name);
+            return 1;
+        }
+        watch_port(devs[i].port, i);
     }
 
-    printf("Started. Forwarding data to %s:%d\n", srv_ip, srv_port);
-
-    char str_buf[64];
-    int pos = 0;
+    printf("Started. Forwarding %d device(s) at %d baud%s to %s:%d\n", count, g_baud,
+           g_framed ? ", framed" : "", srv_ip, srv_port);
 
+    int ready[MAX_DEVICES + 1];
+    unsigned long overflow_reported = 0;
     while (1) {
-        char chunk[1];
-        if (read_data(port, chunk, 1) > 0) {
-            
-            if (chunk[0] != '\n' && pos < 63) {
-                str_buf[pos++] = chunk[0];
+        long long now = now_ms();
+        long long wake = -1;
+        if (batch.count > 0) wake = batch.first_ms + deadline_ms;
+        if (g_spool.file && g_spool.acked != g_spool.next) {
+            long long resend = g_spool.progress_ms + REPLAY_TIMEOUT_MS;
+            if (wake < 0 || resend < wake) wake = resend;
+        }
+        for (int i = 0; i < count; i++) {
+            if (devs[i].port == BAD_PORT && (wake < 0 || devs[i].retry_ms < wake)) wake = devs[i].retry_ms;
+            if (devs[i].beat_ms >= 0 && (wake < 0 || devs[i].beat_ms < wake)) wake = devs[i].beat_ms;
+        }
+        int timeout = wake < 0 ? -1 : wake > now ? (int)(wake - now) : 0;
+
+        int n = wait_ports(ready, count + 1, timeout);
+        for (int r = 0; r < n; r++) {
+            if (ready[r] == MAX_DEVICES) continue; /* acks, read below */
+            Device* dev = &devs[ready[r]];
+            if (ring_fill(&dev->ring, dev->port) < 0) {
+                /* Unplugged or failing: stop watching it and retry later
+                   rather than spinning on the error. */
+                printf("Lost %s, will retry\n", dev->name);
+                send_heartbeats(dev, &batch, sock, deadline_ms >= 0, 1);
+                unwatch_port(dev->port, ready[r]);
+                disconnect(dev->port);
+                dev->port = BAD_PORT;
+                dev->retry_ms = now_ms() + 1000;
                 continue;
             }
+            forward_lines(dev, &batch, sock, deadline_ms >= 0);
+        }
 
-            str_buf[pos] = '\0';
-            pos = 0;
-
-            send_udp_message(sock, str_buf);
-
-        } else {
-            PAUSE(10);
+        now = now_ms();
+        for (int i = 0; i < count; i++) {
+            if (g_deadband >= 0) send_heartbeats(&devs[i], &batch, sock, deadline_ms >= 0, 0);
+        }
+        if (batch.count > 0 && now - batch.first_ms >= deadline_ms) batch_flush(&batch, sock);
+        if (g_spool.file) {
+            spool_read_acks(&g_spool, sock);
+            spool_replay(&g_spool, &replay_batch, sock);
+            if (g_spool.overflowed != overflow_reported) {
+                printf("Spool full, lost %lu oldest readings\n", g_spool.overflowed - overflow_reported);
+                overflow_reported = g_spool.overflowed;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (devs[i].port != BAD_PORT || now < devs[i].retry_ms) continue;
+            devs[i].port = connect_port(devs[i].name);
+            if (devs[i].port == BAD_PORT) {
+                devs[i].retry_ms = now + 1000;
+                continue;
+            }
+            printf("Reopened %s\n", devs[i].name);
+            memset(&devs[i].ring, 0, sizeof(devs[i].ring));
+            devs[i].reported = 0;
+            watch_port(devs[i].port, i);
         }
     }
 
-    disconnect(port);
+    for (int i = 0; i < count; i++) {
+        if (devs[i].port != BAD_PORT) disconnect(devs[i].port);
+    }
+    if (g_spool.file) fclose(g_spool.file);
     close_socket(sock);
     close_network_lib();
     return 0;